@@ -6,17 +6,37 @@ ifneq ($(BUILD_TINY_ANDROID),true)
 
 LOCAL_PATH := $(call my-dir)
 
+# The preview conversion and frame merge kernels use ARMv6
+# media instructions, which Thumb-1 and the default armv5te do not have.
+# Every MSM camera core has them, so these files alone are built as ARM
+# code for at least ARMv6; the rest of the HAL keeps the target defaults.
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := yuvconvert.c.arm framemerge.c.arm
+
+LOCAL_CFLAGS := -O2
+ifeq ($(TARGET_ARCH),arm)
+ifeq ($(filter armv7-a%,$(TARGET_ARCH_VARIANT)),)
+LOCAL_CFLAGS += -march=armv6j
+endif
+endif
+
+LOCAL_MODULE := libcamera_kernels
+include $(BUILD_STATIC_LIBRARY)
+
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := QualcommCameraHardware.cpp exifwriter.c jdatadst.cpp jpegConvert.cpp
 
 LOCAL_CFLAGS := -DDLOPEN_LIBMMCAMERA=$(DLOPEN_LIBMMCAMERA) -O2
 
+LOCAL_STATIC_LIBRARIES := libcamera_kernels
+
 LOCAL_C_INCLUDES += \
     external/jhead \
     external/jpeg
 
-LOCAL_SHARED_LIBRARIES := libbinder libutils libcamera_client liblog libjpeg
+LOCAL_SHARED_LIBRARIES := libbinder libutils libcutils libcamera_client liblog libjpeg
 
 ifneq ($(DLOPEN_LIBMMCAMERA),1)
 LOCAL_SHARED_LIBRARIES += libmmcamera libmm-qcamera-tgt
@@ -30,12 +30,15 @@
 #endif
 #include <linux/ioctl.h>
 #include "raw2jpeg.h"
+#include <cutils/properties.h>
 
 #define LIKELY(exp)   __builtin_expect(!!(exp), 1)
 #define UNLIKELY(exp) __builtin_expect(!!(exp), 0)
 
 extern "C" {
 #include "exifwriter.h"
+#include "yuvconvert.h"
+#include "framemerge.h"
 
 #include <fcntl.h>
 #include <time.h>
@@ -51,6 +54,7 @@ extern "C" {
 #include <errno.h>
 #include <sys/mman.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <stdlib.h>
 #include <poll.h>
 
@@ -110,6 +114,34 @@ static preview_size_type preview_sizes[] = {
     { 192, 144 }, // MMS
 };
 
+// Software zoom cost histograms, in preview_sizes order.
+static const char *const soft_zoom_names[] = {
+    "software zoom, 384x288 preview",
+    "software zoom, 320x240 preview",
+    "software zoom, 240x160 preview",
+    "software zoom, 192x144 preview",
+};
+
+// Matches KEY_ZOOM_RATIOS, for zoom done in software.
+static const int zoom_ratios[] = { 100, 150, 200, 250, 300 };
+#define ZOOM_RATIO_COUNT (sizeof(zoom_ratios)/sizeof(zoom_ratios[0]))
+
+// Vendor parameter keys
+static const char KEY_BURST_COUNT[] = "burst-count";
+static const char KEY_BURST_INTERVAL[] = "burst-interval";
+static const char KEY_BURST_BUFFERS[] = "burst-buffers";
+static const char KEY_NR_FRAMES[] = "noise-reduction-frames";
+static const char KEY_NR_FRAMES_VALUES[] = "noise-reduction-frames-values";
+static const char KEY_CONVERTED_FORMAT[] = "preview-converted-format";
+static const char KEY_CONVERTED_FORMAT_VALUES[] =
+    "preview-converted-format-values";
+// Y plane only, box filtered to half the preview width and height.
+static const char PIXEL_FORMAT_LUMA_HALF[] = "luma-half";
+static const char KEY_SECONDARY_DECIMATION[] = "preview-secondary-decimation";
+static const char KEY_SECONDARY_DOWNSCALE[] = "preview-secondary-downscale";
+static const char KEY_SECONDARY_DOWNSCALE_VALUES[] =
+    "preview-secondary-downscale-values";
+
 static int attr_lookup(const struct str_map *const arr, const char *name)
 {
     if (name) {
@@ -204,25 +236,128 @@ static Mutex singleton_lock;
 static bool singleton_releasing;
 static Condition singleton_wait;
 
-static void receive_camframe_callback(struct msm_frame_t *frame);
+// writeExif() goes through jhead, which keeps the image it is working on
+// in globals and a scratch file, so only one picture may be in it at a
+// time.  Still shots and video snapshots are encoded on different threads.
+static Mutex exif_lock;
+
 static void receive_jpeg_fragment_callback(uint8_t *buff_ptr, uint32_t buff_size);
 static void receive_jpeg_callback(jpeg_event_t status);
 
 static int camerafd;
 static int framefd;
-pthread_t w_thread;
-pthread_t jpegThread;
 
-void *opencamerafd(void *arg) {
-    camerafd = open(MSM_CAMERA_CONTROL, O_RDWR);
-    if (camerafd < 0)
-        LOGE("Camera control %s open failed: %s!", MSM_CAMERA_CONTROL, strerror(errno));
+// Device nodes and libraries the HAL talks to.  On debuggable builds each
+// can be pointed elsewhere with a debug.camera.* property, to try another
+// driver or library build without reflashing.  Elsewhere those properties
+// are ignored: any shell could otherwise have the media server load code
+// of its choosing.
+static char camera_control_path[PROPERTY_VALUE_MAX];
+static char pmem_adsp_path[PROPERTY_VALUE_MAX];
+static char pmem_camera_path[PROPERTY_VALUE_MAX];
+static char mmcamera_lib[PROPERTY_VALUE_MAX];
+static char mmcamera_target_lib[PROPERTY_VALUE_MAX];
+
+static void load_device_path(const char *key, char *value,
+                             const char *default_value, bool debuggable)
+{
+    if (debuggable)
+        property_get(key, value, default_value);
     else
-        LOGD("opening %s fd: %d", MSM_CAMERA_CONTROL, camerafd);
+        snprintf(value, PROPERTY_VALUE_MAX, "%s", default_value);
+}
 
-    return NULL;
+static void load_device_paths()
+{
+    char value[PROPERTY_VALUE_MAX];
+    property_get("ro.debuggable", value, "0");
+    bool debuggable = !strcmp(value, "1");
+
+    load_device_path("debug.camera.control", camera_control_path,
+                     MSM_CAMERA_CONTROL, debuggable);
+    load_device_path("debug.camera.pmem_adsp", pmem_adsp_path,
+                     "/dev/pmem_adsp", debuggable);
+    load_device_path("debug.camera.pmem_camera", pmem_camera_path,
+                     "/dev/pmem_camera", debuggable);
+    load_device_path("debug.camera.lib", mmcamera_lib,
+                     "libmmcamera.so", debuggable);
+    load_device_path("debug.camera.lib_tgt", mmcamera_target_lib,
+                     "libmm-qcamera-tgt.so", debuggable);
+}
+
+static int preview_buffer_count()
+{
+    char value[PROPERTY_VALUE_MAX];
+    property_get("persist.camera.preview.buffers", value, "4");
+    int count = atoi(value);
+    if (count < QualcommCameraHardware::kPreviewBufferCountMin)
+        count = QualcommCameraHardware::kPreviewBufferCountMin;
+    else if (count > QualcommCameraHardware::kPreviewBufferCountMax)
+        count = QualcommCameraHardware::kPreviewBufferCountMax;
+    return count;
 }
 
+// Starting point for the compressed size at each band of ten JPEG quality
+// points, in 8.8 fixed point bytes per pixel, until a picture has been
+// taken at that quality.  Pitched at a detailed, noisy scene so that the
+// first pictures rarely need the overflow heap.
+static const uint32_t jpeg_prior_bytes_per_pixel[] = {
+    26, 38, 51, 64, 72, 82, 97, 118, 154, 230, 384
+};
+
+// Memory the low memory killer would count as free, free plus page
+// cache, in kB; -1 if /proc/meminfo cannot be read.
+static int available_memory_kb()
+{
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (f == NULL)
+        return -1;
+
+    char line[128];
+    int freeKb = -1, cachedKb = 0, kb;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "MemFree: %d kB", &kb) == 1)
+            freeKb = kb;
+        else if (sscanf(line, "Cached: %d kB", &kb) == 1)
+            cachedKb = kb;
+    }
+    fclose(f);
+    return freeKb < 0 ? -1 : freeKb + cachedKb;
+}
+
+// Below the low memory killer's last level it starts killing empty
+// background processes; the camera counts memory as low from there on.
+static int low_memory_threshold_kb()
+{
+    char value[PROPERTY_VALUE_MAX];
+    property_get("persist.camera.mem_low_kb", value, "0");
+    int kb = atoi(value);
+    if (kb > 0)
+        return kb;
+
+    kb = 16 * 1024;
+    FILE *f = fopen("/sys/module/lowmemorykiller/parameters/minfree", "r");
+    if (f != NULL) {
+        int pages, last = -1;
+        while (fscanf(f, "%d,", &pages) == 1)
+            last = pages;
+        fclose(f);
+        if (last > 0)
+            kb = last * (getpagesize() / 1024);
+    }
+    return kb;
+}
+
+// Each capture stage histogram holds the time from the previous stage.
+static const char *const capture_stage_names[] = {
+    "capture: request -> shutter",
+    "capture: shutter -> raw ready",
+    "capture: raw ready -> encode start",
+    "capture: encode start -> encode end",
+    "capture: encode end -> exif done",
+    "capture: exif done -> jpeg delivered",
+};
+
 QualcommCameraHardware::QualcommCameraHardware()
     : mParameters(),
       mPreviewHeight(-1),
@@ -232,9 +367,66 @@ QualcommCameraHardware::QualcommCameraHardware()
       mCameraRunning(false),
       mPreviewInitialized(false),
       mRawInitialized(false),
+      mSnapshotPoolAllocs(0),
+      mSnapshotPoolReuses(0),
+      mSnapshotPoolSetup("snapshot pool setup"),
+      mMemoryLow(false),
+      mMemoryAvailableKb(-1),
+      mMemoryLowKb(0),
+      mMemoryTrims(0),
+      mJpegOverflows(0),
       mFrameThreadRunning(false),
+      mFrameThreadStarted(false),
+      mShutterRequestTime(0),
+      mShutterLag("shutter request-to-notify latency"),
+      mShutterToJpeg("shutter request-to-jpeg callback latency"),
       mSnapshotThreadRunning(false),
-      mReleasedRecordingFrame(false),
+      mParmCommandsSent(0),
+      mParmCommandsSkipped(0),
+      mSetParametersCost("setParameters"),
+      mZoomThreadRunning(false),
+      mZoomThreadExit(false),
+      mZoomStep(0),
+      mZoomTarget(-1),
+      mZoomCurrent(-1),
+      mSmoothZooming(false),
+      mSoftZoomRatio(100),
+      mPreviewSizeIndex(DEFAULT_PREVIEW_SETTING),
+      mZoomScratch(NULL),
+      mZoomScratchSize(0),
+      mSoftZoomThreadRunning(false),
+      mSoftZoomThreadExit(false),
+      mSoftZoomDelivering(false),
+      mSoftZoomQueuedSlot(-1),
+      mSoftZoomQueuedTime(0),
+      mSoftZoomFramesReplaced(0),
+      mSoftZoomSnapshotCost("software zoom, snapshot"),
+      mPreviewRestartPending(false),
+      mPreviewPaused(false),
+      mSnapshotGeneration(0),
+      mShotToPreview("takePicture-to-preview restart latency"),
+      mBurstCount(1),
+      mBurstInterval(0),
+      mEncodeSlots(kEncodeSlotsMax / 2),
+      mEncodeThreadRunning(false),
+      mEncodeThreadExit(false),
+      mShotLatency("burst shot request-to-jpeg latency"),
+      mLastBurstShots(0),
+      mLastBurstDuration(0),
+      mNrFrames(1),
+      mNrSlot(-1),
+      mNrFramesMerged(0),
+      mNrReference(NULL),
+      mNrMergeCost("noise reduction frame merge"),
+      mVideoSnapshotPending(false),
+      mVideoSnapshotThreadRunning(false),
+      mVideoSnapshots(0),
+      mVideoSnapshotLatency("video snapshot request-to-jpeg latency"),
+      mVideoSnapshotCopy("video snapshot frame copy"),
+      mRecordFramesHeld(0),
+      mRecordFramesHeldMax(0),
+      mRecordFramesDelivered(0),
+      mRecordFramesDropped(0),
       mNotifyCb(0),
       mDataCb(0),
       mDataCbTimestamp(0),
@@ -242,16 +434,55 @@ QualcommCameraHardware::QualcommCameraHardware()
       mMsgEnabled(0),
       mPreviewFrameSize(0),
       mRawSize(0),
+      mJpegMaxSize(0),
       mCameraControlFd(-1),
+      mPreviewStartLatency(0),
+      mPreviewStopLatency(0),
+      mLastCaptureTime(0),
+      mFramePeriod(0),
+      mCaptureToCallback("video capture-to-callback latency"),
+      mPreviewToCallback("preview frame-to-callback latency"),
+      mPreviewCallbackTime("preview callback duration"),
+      mFrameThreadTime("frame thread time per frame"),
+      mPreviewBufferCount(kPreviewBufferCountMin),
+      mDisplayedPreviewSlot(-1),
+      mPreviewFormat(PREVIEW_FORMAT_YUV420SP),
+      mConvertWidth(0),
+      mConvertHeight(0),
+      mConvertSlot(0),
+      mPreviewConvertCost("preview format conversion"),
+      mSecondaryDecimation(0),
+      mSecondaryShift(0),
+      mSecondaryWidth(0),
+      mSecondaryHeight(0),
+      mSecondarySlot(0),
+      mSecondaryFrameCount(0),
+      mSecondaryFramesSent(0),
+      mSecondaryCost("secondary preview downscale"),
       mInPreviewCallback(false),
       mCameraRecording(false)
 {
     LOGD("constructor EX");
-    if((pthread_create(&w_thread, NULL, opencamerafd, NULL)) != 0) {
-        LOGE("Camera open thread creation failed");
-    }
     memset(&mDimension, 0, sizeof(mDimension));
     memset(&mCrop, 0, sizeof(mCrop));
+    mFrameThreadPipe[0] = mFrameThreadPipe[1] = -1;
+    for (int stage = 0; stage < CAPTURE_STAGE_COUNT; stage++)
+        mCaptureStages[stage].mName = capture_stage_names[stage];
+    for (int size = 0; size < kPreviewSizeCount; size++)
+        mSoftZoomPreviewCost[size].mName = soft_zoom_names[size];
+    memset(mStartupPhase, 0, sizeof(mStartupPhase));
+    memset(mStartupThreadStarted, 0, sizeof(mStartupThreadStarted));
+    memset(mJpegBytesPerPixel, 0, sizeof(mJpegBytesPerPixel));
+
+    // Effect and white balance start out as the driver's defaults.
+    mWantedSettings.effect = NOT_FOUND;
+    mWantedSettings.whiteBalance = NOT_FOUND;
+    mWantedSettings.zoomStep = NOT_FOUND;
+    mWantedSettings.zoom = NOT_FOUND;
+    mAppliedSettings.effect = 1;
+    mAppliedSettings.whiteBalance = 1;
+    mAppliedSettings.zoomStep = 0;
+    mAppliedSettings.zoom = NOT_FOUND;
 }
 
 void QualcommCameraHardware::initDefaultParameters()
@@ -299,9 +530,18 @@ void QualcommCameraHardware::initDefaultParameters()
     p.set(CameraParameters::KEY_ZOOM, "0");
     p.set(CameraParameters::KEY_MAX_ZOOM, "4");
     p.set(CameraParameters::KEY_ZOOM_RATIOS, "100,150,200,250,300");
-
-    mEffect = 1;
-    mWhiteBalance = 1;
+    p.set(CameraParameters::KEY_SMOOTH_ZOOM_SUPPORTED, "true");
+
+    p.set(KEY_BURST_COUNT, 1);
+    p.set(KEY_BURST_INTERVAL, 0);
+    p.set(KEY_BURST_BUFFERS, 2);
+    p.set(KEY_NR_FRAMES, 1);
+    p.set(KEY_NR_FRAMES_VALUES, "1,2,3,4");
+    p.set(KEY_CONVERTED_FORMAT, "off");
+    p.set(KEY_CONVERTED_FORMAT_VALUES, "off,rgb565,luma-half");
+    p.set(KEY_SECONDARY_DECIMATION, 0);
+    p.set(KEY_SECONDARY_DOWNSCALE, 2);
+    p.set(KEY_SECONDARY_DOWNSCALE_VALUES, "1,2,4,8");
 
     if (setParameters(p) != NO_ERROR) {
         LOGE("Failed to set default parameters?!");
@@ -346,77 +586,163 @@ bool QualcommCameraHardware::msgTypeEnabled(int32_t msgType)
 
 #define ROUND_TO_PAGE(x)  (((x)+0xfff)&~0xfff)
 
-void QualcommCameraHardware::startCamera()
+static const char *const startup_phase_names[] = {
+    "load camera libraries",
+    "open camera device",
+    "preallocate preview pool",
+    "default parameters",
+    "jpeg encoder init",
+    "config thread start",
+    "total",
+};
+
+void *startup_thread(void *phase)
 {
-    LOGD("startCamera E");
+    sp<QualcommCameraHardware> obj = QualcommCameraHardware::getInstance();
+    if (obj != 0) {
+        obj->runStartupPhase((int)phase);
+    }
+    else LOGW("not running startup phase: the object went away!");
+    return NULL;
+}
 
+// Camera open, broken into the steps that do not depend on each other.
+// The library loads, the device opens and the preview pool allocation
+// each get a thread; startCamera() joins them before the steps that need
+// their results.  The two libraries share one thread, as the loader lock
+// serializes dlopen() anyway.
+void QualcommCameraHardware::runStartupPhase(int phase)
+{
+    nsecs_t start = systemTime();
+
+    switch (phase) {
+    case STARTUP_LOAD_LIBRARIES:
 #if DLOPEN_LIBMMCAMERA
-    libmmcamera = ::dlopen("libmmcamera.so", RTLD_NOW);
-    LOGV("loading libmmcamera at %p", libmmcamera);
-    if (!libmmcamera) {
-        LOGE("FATAL ERROR: could not dlopen libmmcamera.so: %s", dlerror());
-        return;
-    }
+        libmmcamera = ::dlopen(mmcamera_lib, RTLD_NOW);
+        LOGV("loading %s at %p", mmcamera_lib, libmmcamera);
+        if (!libmmcamera) {
+            LOGE("FATAL ERROR: could not dlopen %s: %s", mmcamera_lib, dlerror());
+            break;
+        }
 
-    libmmcamera_target = ::dlopen("libmm-qcamera-tgt.so", RTLD_NOW);
-    LOGV("loading libmm-qcamera-tgt at %p", libmmcamera_target);
-    if (!libmmcamera_target) {
-        LOGE("FATAL ERROR: could not dlopen libmm-qcamera_target.so: %s", dlerror());
-        return;
-    }
+        *(void **)&LINK_jpeg_encoder_init =
+            ::dlsym(libmmcamera, "jpeg_encoder_init");
 
-    *(void **)&LINK_jpeg_encoder_init =
-        ::dlsym(libmmcamera, "jpeg_encoder_init");
+        *(void **)&LINK_cam_release_frame =
+            ::dlsym(libmmcamera, "cam_release_frame");
 
-    *(void **)&LINK_cam_release_frame =
-        ::dlsym(libmmcamera, "cam_release_frame");
+        *(void **)&LINK_mmcamera_jpegfragment_callback =
+            ::dlsym(libmmcamera, "mm_jpegfragment_callback");
 
-    *(void **)&LINK_mmcamera_jpegfragment_callback =
-        ::dlsym(libmmcamera, "mm_jpegfragment_callback");
+        *LINK_mmcamera_jpegfragment_callback = receive_jpeg_fragment_callback;
 
-    *LINK_mmcamera_jpegfragment_callback = receive_jpeg_fragment_callback;
+        *(void **)&LINK_mmcamera_jpeg_callback =
+            ::dlsym(libmmcamera, "mm_jpeg_callback");
 
-    *(void **)&LINK_mmcamera_jpeg_callback =
-        ::dlsym(libmmcamera, "mm_jpeg_callback");
+        *LINK_mmcamera_jpeg_callback = receive_jpeg_callback;
 
-    *LINK_mmcamera_jpeg_callback = receive_jpeg_callback;
+        *(void**)&LINK_jpeg_encoder_setMainImageQuality =
+            ::dlsym(libmmcamera, "jpeg_encoder_setMainImageQuality");
 
-    *(void**)&LINK_jpeg_encoder_setMainImageQuality =
-        ::dlsym(libmmcamera, "jpeg_encoder_setMainImageQuality");
+        libmmcamera_target = ::dlopen(mmcamera_target_lib, RTLD_NOW);
+        LOGV("loading %s at %p", mmcamera_target_lib, libmmcamera_target);
+        if (!libmmcamera_target) {
+            LOGE("FATAL ERROR: could not dlopen %s: %s", mmcamera_target_lib,
+                 dlerror());
+            break;
+        }
 
-    *(void **)&LINK_cam_conf =
-        ::dlsym(libmmcamera_target, "cam_conf");
+        *(void **)&LINK_cam_conf =
+            ::dlsym(libmmcamera_target, "cam_conf");
 #else
-    mmcamera_jpegfragment_callback = receive_jpeg_fragment_callback;
-    mmcamera_jpeg_callback = receive_jpeg_callback;
+        mmcamera_jpegfragment_callback = receive_jpeg_fragment_callback;
+        mmcamera_jpeg_callback = receive_jpeg_callback;
 #endif // DLOPEN_LIBMMCAMERA
+        break;
+
+    case STARTUP_OPEN_DEVICE:
+        camerafd = open(camera_control_path, O_RDWR);
+        if (camerafd < 0)
+            LOGE("Camera control %s open failed: %s!", camera_control_path, strerror(errno));
+        else
+            LOGD("opening %s fd: %d", camera_control_path, camerafd);
+
+        // maintain a fd for frame thread later
+        framefd = open(camera_control_path, O_RDWR);
+        if (framefd < 0)
+            LOGE("cam_frame: cannot open %s: %s",
+                camera_control_path, strerror(errno));
+        break;
+
+    case STARTUP_PREVIEW_POOL: {
+        // Preview buffers are registered with the driver only in
+        // initPreview(), so the pmem itself can be set up without it.
+        preview_size_type *ps = &preview_sizes[DEFAULT_PREVIEW_SETTING];
+        sp<PreviewPmemPool> heap =
+            new PreviewPmemPool(-1,
+                                ROUND_TO_PAGE(ps->width * ps->height * 3/2),
+                                preview_buffer_count(),
+                                ps->width * ps->height * 3/2,
+                                0,
+                                "preview");
+        if (heap->initialized())
+            mPreviewHeap = heap;
+        break;
+    }
+    }
 
+    mStartupPhase[phase] = systemTime() - start;
+}
 
-    /* The control thread is in libcamera itself. */
-    LOGD("pthread_join on control thread");
-    if (pthread_join(w_thread, NULL) != 0) {
-        LOGE("Camera open thread exit failed");
-        return;
+void QualcommCameraHardware::beginStartup()
+{
+    mStartupBegin = systemTime();
+
+    for (int phase = 0; phase < STARTUP_ASYNC_PHASE_COUNT; phase++) {
+        mStartupThreadStarted[phase] =
+            !pthread_create(&mStartupThread[phase], NULL, startup_thread,
+                            (void *)phase);
+        if (!mStartupThreadStarted[phase]) {
+            LOGE("startup thread %d creation failed, running inline", phase);
+            runStartupPhase(phase);
+        }
     }
+}
 
-    mCameraControlFd = camerafd;
+void QualcommCameraHardware::startCamera()
+{
+    LOGD("startCamera E");
 
-    // maintain a fd for frame thread later
-    framefd = open(MSM_CAMERA_CONTROL, O_RDWR);
-    if (framefd < 0)
-        LOGE("cam_frame: cannot open %s: %s",
-            MSM_CAMERA_CONTROL, strerror(errno));
+    for (int phase = 0; phase < STARTUP_ASYNC_PHASE_COUNT; phase++) {
+        if (mStartupThreadStarted[phase] &&
+            pthread_join(mStartupThread[phase], NULL) != 0)
+            LOGE("startup thread %d exit failed", phase);
+        mStartupThreadStarted[phase] = false;
+    }
+
+#if DLOPEN_LIBMMCAMERA
+    if (!libmmcamera || !libmmcamera_target)
+        return;
+#endif
+
+    mCameraControlFd = camerafd;
 
+    nsecs_t start = systemTime();
     if (!LINK_jpeg_encoder_init()) {
         LOGE("jpeg_encoding_init failed.");
     }
+    mStartupPhase[STARTUP_JPEG_INIT] = systemTime() - start;
 
+    start = systemTime();
     if ((pthread_create(&mCamConfigThread, NULL, LINK_cam_conf, NULL)) != 0)
         LOGE("Config thread creation failed!");
     else
         LOGD("Config thread created successfully");
+    mStartupPhase[STARTUP_CONFIG_THREAD] = systemTime() - start;
 
-    LOGD("startCamera X");
+    mStartupPhase[STARTUP_TOTAL] = systemTime() - mStartupBegin;
+    LOGD("startCamera X: camera open took %lld us",
+         mStartupPhase[STARTUP_TOTAL] / 1000);
 }
 
 status_t QualcommCameraHardware::dump(int fd,
@@ -439,7 +765,81 @@ status_t QualcommCameraHardware::dump(int fd,
              "and jpeg max size (%d)\n", mPreviewFrameSize, mRawSize,
              mJpegSize, mJpegMaxSize);
     result.append(buffer);
+    snprintf(buffer, 255, "last preview start (%lld us), stop (%lld us)\n",
+             mPreviewStartLatency / 1000, mPreviewStopLatency / 1000);
+    result.append(buffer);
+    snprintf(buffer, 255, "video frames delivered (%u), dropped (%u), "
+             "held by encoder (%d, max %d)\n",
+             mRecordFramesDelivered, mRecordFramesDropped,
+             mRecordFramesHeld, mRecordFramesHeldMax);
+    result.append(buffer);
+    write(fd, result.string(), result.size());
+
+    mCaptureToCallback.dump(fd);
+    mPreviewToCallback.dump(fd);
+    mPreviewCallbackTime.dump(fd);
+    mFrameThreadTime.dump(fd);
+    // Which kernels were built in, so that timings from different builds
+    // can be told apart.
+    snprintf(buffer, 255, "preview converted format (%s), %s kernels\n",
+             mPreviewFormat == PREVIEW_FORMAT_RGB565 ? "rgb565" :
+             mPreviewFormat == PREVIEW_FORMAT_LUMA_HALF ? "luma-half" : "off",
+             yuvconvert_kernels());
+    write(fd, buffer, strlen(buffer));
+    mPreviewConvertCost.dump(fd);
+    snprintf(buffer, 255, "secondary preview every %d frames at 1/%d size "
+             "(%dx%d), sent (%u)\n", mSecondaryDecimation,
+             1 << mSecondaryShift, mSecondaryWidth, mSecondaryHeight,
+             mSecondaryFramesSent);
+    write(fd, buffer, strlen(buffer));
+    mSecondaryCost.dump(fd);
+    snprintf(buffer, 255, "zoom in %s, software ratio (%d%%), "
+             "preview frames replaced while scaling (%u)\n",
+             mZoomStep == 0 ? "software" : "hardware", mSoftZoomRatio,
+             mSoftZoomFramesReplaced);
+    write(fd, buffer, strlen(buffer));
+    for (int size = 0; size < kPreviewSizeCount; size++)
+        mSoftZoomPreviewCost[size].dump(fd);
+    mSoftZoomSnapshotCost.dump(fd);
+    for (int stage = 0; stage < CAPTURE_STAGE_COUNT; stage++)
+        mCaptureStages[stage].dump(fd);
+    snprintf(buffer, 255, "snapshot pools %s, allocated (%u), reused (%u)\n",
+             mRawInitialized ? "resident" : "released",
+             mSnapshotPoolAllocs, mSnapshotPoolReuses);
+    write(fd, buffer, strlen(buffer));
+    mSnapshotPoolSetup.dump(fd);
+    snprintf(buffer, 255, "burst count (%d), interval (%lld ms), "
+             "encode slots (%d), last burst (%d shots in %lld ms)\n",
+             mBurstCount, mBurstInterval / 1000000, mEncodeSlots,
+             mLastBurstShots, mLastBurstDuration / 1000000);
+    write(fd, buffer, strlen(buffer));
+    mShotLatency.dump(fd);
+    snprintf(buffer, 255, "noise reduction frames (%d), %s kernels\n",
+             mNrFrames, framemerge_kernels());
+    write(fd, buffer, strlen(buffer));
+    mNrMergeCost.dump(fd);
+    snprintf(buffer, 255, "video snapshots taken (%u)\n", mVideoSnapshots);
+    write(fd, buffer, strlen(buffer));
+    mVideoSnapshotCopy.dump(fd);
+    mVideoSnapshotLatency.dump(fd);
+    mShotToPreview.dump(fd);
+    snprintf(buffer, 255, "driver parameter commands sent (%u), "
+             "skipped as unchanged (%u)\n",
+             mParmCommandsSent, mParmCommandsSkipped);
+    write(fd, buffer, strlen(buffer));
+    mSetParametersCost.dump(fd);
+
+    result = "camera startup:\n";
+    for (int phase = 0; phase < STARTUP_PHASE_COUNT; phase++) {
+        snprintf(buffer, 255, "  %-26s %8lld us\n",
+                 startup_phase_names[phase], mStartupPhase[phase] / 1000);
+        result.append(buffer);
+    }
     write(fd, result.string(), result.size());
+    mShutterLag.dump(fd);
+    mShutterToJpeg.dump(fd);
+
+    dumpMemoryUsage(fd);
 
     // Dump internal objects.
     if (mPreviewHeap != 0) {
@@ -670,45 +1070,6 @@ void *jpeg_encoder_thread( void *user )
     return NULL;
 }
 
-static bool mJpegThreadRunning = false;
-bool QualcommCameraHardware::native_jpeg_encode(void)
-{
-    int jpeg_quality = mParameters.getInt("jpeg-quality");
-    if (jpeg_quality >= 0) {
-        LOGV("native_jpeg_encode, current jpeg main img quality = %d",
-             jpeg_quality);
-        if(!LINK_jpeg_encoder_setMainImageQuality(jpeg_quality)) {
-            LOGE("native_jpeg_encode set jpeg-quality failed");
-            return false;
-        }
-        LOGV("jpeg main img quality done");
- 
-    }
-
-    int thumbnail_quality = mParameters.getInt("jpeg-thumbnail-quality");
-    if (thumbnail_quality >= 0) {
-        LOGV("native_jpeg_encode, current jpeg thumbnail quality = %d",
-             thumbnail_quality);
-    }
-
-    int rotation = mParameters.getInt("rotation");
-    if (rotation >= 0) {
-        LOGV("native_jpeg_encode, rotation = %d", rotation);
-    }
-
-    mDimension.filler7 = 2560;
-    mDimension.filler8 = 1920;
-
-    int ret = !pthread_create(&jpegThread,
-                              NULL,
-                              jpeg_encoder_thread,
-                              NULL);
-    if (ret)
-        mJpegThreadRunning = true;
-
-    return true;
-}
-
 bool QualcommCameraHardware::native_set_dimension(cam_ctrl_dimension_t *value)
 {
     LOGD("native_set_dimension: EX");
@@ -738,81 +1099,249 @@ bool QualcommCameraHardware::native_set_parm(
     return true;
 }
 
-static void handler(int sig, siginfo_t *siginfo, void *context)
+// Commands written to the frame thread's wakeup pipe.
+enum {
+    FRAME_THREAD_EXIT = 'x',
+    FRAME_THREAD_PARAMS_CHANGED = 'p',
+};
+
+void *frame_thread(void *user)
 {
-    pthread_exit(NULL);
+    LOGD("frame_thread E");
+    sp<QualcommCameraHardware> obj = QualcommCameraHardware::getInstance();
+    if (obj != 0) {
+        obj->runFrameThread(user);
+    }
+    else LOGW("not starting frame thread: the object went away!");
+    LOGD("frame_thread X");
+    return NULL;
 }
 
 // customized cam_frame function based on libmmcamera.so
-static void *cam_frame_click(void *data)
+void QualcommCameraHardware::runFrameThread(void *data)
 {
-    LOGD("Entering cam_frame_click");
-
-    struct msm_frame_t *frame = (msm_frame_t *)data;
+    // GETFRAME overwrites the struct with the filled buffer; start from a
+    // copy of a ring entry so path/fd are set up.
+    struct msm_frame_t frame = *(msm_frame_t *)data;
+    struct pollfd fds[2];
 
-    struct sigaction act;
+    fds[0].fd = framefd;
+    fds[0].events = POLLIN;
+    fds[1].fd = mFrameThreadPipe[0];
+    fds[1].events = POLLIN;
 
-    pthread_mutex_t mutex_camframe = PTHREAD_MUTEX_INITIALIZER;
-    struct timeval timeout;
-    fd_set readfds;
-    int ret;
-
-    // found in assembled codes
-    memset(&readfds, 0, sizeof(readfds));
+    while (true) {
+        fds[0].revents = fds[1].revents = 0;
 
-    act.sa_sigaction = &handler;
-    act.sa_flags = SA_SIGINFO;
-    if (sigaction(SIGUSR1, &act, NULL) != 0) {
-        LOGE("sigaction in cam_frame failed");
-        pthread_exit(NULL);
-    }
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            LOGE("frame thread: poll() failed: %s", strerror(errno));
+            break;
+        }
 
-    FD_ZERO(&readfds);
-    FD_SET(framefd, &readfds);
+        if (fds[1].revents & POLLIN) {
+            char cmd = 0;
+            if (read(mFrameThreadPipe[0], &cmd, 1) == 1) {
+                if (cmd == FRAME_THREAD_EXIT) {
+                    LOGD("frame thread: exit requested");
+                    break;
+                }
+                LOGV("frame thread: woken up (%c)", cmd);
+            }
+        }
 
-    while (true) {
-        timeout.tv_sec = 1; // guess
-        timeout.tv_usec = 0;
+        if (fds[0].revents & POLLIN) {
+            nsecs_t captureTime = estimateCaptureTime(systemTime());
 
-        ret = select(framefd+1, &readfds, NULL, NULL, &timeout);
-        if (FD_ISSET(framefd, &readfds)) {
-            pthread_mutex_lock(&mutex_camframe);
             // ready to get frame
-            ret = ioctl(framefd, MSM_CAM_IOCTL_GETFRAME, frame);
-            if (ret >= 0) {
-                // put buffers to config VFE
-                if (ioctl(framefd, MSM_CAM_IOCTL_RELEASE_FRAMEE_BUFFER, frame) < 0)
-                    LOGE("MSM_CAM_IOCTL_RELEASE_FRAME_BUFFER error %s", strerror(errno));
-                else
-                    receive_camframe_callback(frame);
+            if (ioctl(framefd, MSM_CAM_IOCTL_GETFRAME, &frame) >= 0) {
+                int slot = previewSlotFor(&frame);
+                if (slot < 0) {
+                    LOGE("frame thread: unknown preview buffer 0x%lx",
+                         frame.buffer);
+                    if (ioctl(framefd, MSM_CAM_IOCTL_RELEASE_FRAMEE_BUFFER, &frame) < 0)
+                        LOGE("MSM_CAM_IOCTL_RELEASE_FRAME_BUFFER error %s", strerror(errno));
+                } else {
+                    frames[slot] = frame;
+
+                    // Held by the frame thread for the duration of the
+                    // callbacks; the buffer is requeued by whoever drops
+                    // the last reference.
+                    nsecs_t start = systemTime();
+                    acquirePreviewSlot(slot);
+                    receivePreviewFrame(&frames[slot], captureTime);
+                    releasePreviewSlot(slot);
+                    mFrameThreadTime.add(systemTime() - start);
+                }
             } else
                 LOGE("MSM_CAM_IOCTL_GETFRAME error %s", strerror(errno));
-            pthread_mutex_unlock(&mutex_camframe);
-        } else if (ret == -1) {
-            LOGE("calling select() failed!");
+        } else if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            LOGE("frame thread: frame fd error (revents 0x%x)", fds[0].revents);
             break;
+        }
+    }
+
+    mFrameThreadWaitLock.lock();
+    mFrameThreadRunning = false;
+    mFrameThreadWait.signal();
+    mFrameThreadWaitLock.unlock();
+}
+
+// The kernel does not report when the VFE finished a frame, so the wakeup
+// of the frame thread is the earliest observation we get. Scheduling delay
+// only ever makes it late, and frames arrive at the sensor's fixed rate:
+// track that rate and pull each stamp towards the predicted arrival.
+nsecs_t QualcommCameraHardware::estimateCaptureTime(nsecs_t observed)
+{
+    nsecs_t estimate = observed;
+
+    if (mLastCaptureTime != 0) {
+        nsecs_t interval = observed - mLastCaptureTime;
+        // Only an interval the sensor could run at may become the period:
+        // frames drained in a burst after a stall arrive much closer
+        // together than they were captured.
+        bool plausible = interval >= kMinFramePeriod &&
+                         interval <= kMaxFramePeriod;
+
+        if (mFramePeriod == 0) {
+            if (plausible)
+                mFramePeriod = interval;
         } else {
-            LOGD("frame is not ready!");
-            usleep(100000);
+            nsecs_t error = interval - mFramePeriod;
+            if (error < mFramePeriod / 2 && error > -mFramePeriod / 2) {
+                estimate = mLastCaptureTime + mFramePeriod + error / 8;
+                mFramePeriod += error / 32;
+            } else if (interval < mFramePeriod * 2) {
+                // The sensor rate really changed; start tracking again.
+                if (plausible)
+                    mFramePeriod = interval;
+            } else {
+                // Dropped frames or a stall: resync on the observation and
+                // seed the period afresh from the next plausible interval.
+                mFramePeriod = 0;
+            }
         }
     }
 
-    return NULL;
+    if (estimate > observed)
+        estimate = observed;
+
+    mLastCaptureTime = estimate;
+    return estimate;
+}
+
+bool QualcommCameraHardware::startFrameThread(struct msm_frame_t *frame)
+{
+    if (pipe(mFrameThreadPipe) < 0) {
+        LOGE("frame thread: pipe() failed: %s", strerror(errno));
+        return false;
+    }
+
+    mLastCaptureTime = 0;
+    mFramePeriod = 0;
+
+    mFrameThreadWaitLock.lock();
+    mFrameThreadRunning = !pthread_create(&mFrameThread,
+                                          NULL,
+                                          frame_thread,
+                                          frame);
+    mFrameThreadWaitLock.unlock();
+
+    if (!mFrameThreadRunning) {
+        LOGE("pthread_create error");
+        close(mFrameThreadPipe[0]);
+        close(mFrameThreadPipe[1]);
+        mFrameThreadPipe[0] = mFrameThreadPipe[1] = -1;
+        return false;
+    }
+
+    mFrameThreadStarted = true;
+    LOGD("Preview thread created");
+    return true;
+}
+
+void QualcommCameraHardware::stopFrameThread()
+{
+    if (!mFrameThreadStarted)
+        return;
+
+    // The thread may already have quit on a frame fd error; the join below
+    // works either way.
+    char cmd = FRAME_THREAD_EXIT;
+    if (write(mFrameThreadPipe[1], &cmd, 1) != 1)
+        LOGE("frame thread: could not send exit: %s", strerror(errno));
+
+    LOGD("stopFrameThread: joining frame thread");
+    if (pthread_join(mFrameThread, NULL) != 0)
+        LOGE("frame thread join failed: %s", strerror(errno));
+
+    close(mFrameThreadPipe[0]);
+    close(mFrameThreadPipe[1]);
+    mFrameThreadPipe[0] = mFrameThreadPipe[1] = -1;
+    mFrameThreadStarted = false;
+}
+
+void QualcommCameraHardware::wakeFrameThread()
+{
+    if (!mFrameThreadStarted)
+        return;
+
+    char cmd = FRAME_THREAD_PARAMS_CHANGED;
+    write(mFrameThreadPipe[1], &cmd, 1);
 }
 
 void QualcommCameraHardware::runJpegEncodeThread(void *data)
 {
-    unsigned char *buffer;
+    LOGD("runJpegEncodeThread E");
+
+    for (;;) {
+        mEncodeLock.lock();
+        while (mEncodeQueue.isEmpty() && !mEncodeThreadExit)
+            mEncodeCondition.wait(mEncodeLock);
+        if (mEncodeQueue.isEmpty()) {
+            mEncodeLock.unlock();
+            break;
+        }
+        int slot = mEncodeQueue[0];
+        mEncodeQueue.removeAt(0);
+        EncodeJob job = mEncodeJobs[slot];
+        mEncodeLock.unlock();
+
+        if (job.mMergeFrames > 1) {
+            slot = mergeNoiseReductionFrame(slot, job);
+            if (slot < 0)
+                continue;
+            // One picture for the whole group, timed from takePicture().
+            job.mShot = 0;
+            job.mBurstCount = 1;
+            job.mRequestTime = job.mBurstStart;
+        }
+
+        encodeJpeg(slot, job);
+        releaseEncodeSlot(slot);
+    }
+
+    // A group cut short by a failed shot never completes.
+    resetNoiseReduction();
+
+    LOGD("runJpegEncodeThread X");
+}
+
+void QualcommCameraHardware::encodeJpeg(int slot, const EncodeJob &job)
+{
+    const CameraParameters &params = job.mParameters;
 
-    int rotation = mParameters.getInt("rotation");
-    LOGD("native_jpeg_encode, rotation = %d", rotation);
+    int rotation = params.getInt("rotation");
+    LOGD("encodeJpeg: shot %d/%d, rotation = %d",
+         job.mShot + 1, job.mBurstCount, rotation);
 
     bool encode_location = true;
     camera_position_type pt;
 
 #define PARSE_LOCATION(what,type,fmt,desc) do {                                \
         pt.what = 0;                                                           \
-        const char *what##_str = mParameters.get("gps-"#what);                 \
+        const char *what##_str = params.get("gps-"#what);                      \
         LOGD("GPS PARM %s --> [%s]", "gps-"#what, what##_str);                 \
         if (what##_str) {                                                      \
             type what = 0;                                                     \
@@ -848,32 +1377,491 @@ void QualcommCameraHardware::runJpegEncodeThread(void *data)
     if(!encode_location)
         npt = NULL;
 
-    int jpeg_quality = mParameters.getInt("jpeg-quality");
-    if (yuv420_save2jpeg((unsigned char*) mJpegHeap->mHeap->base(),
-        mRawHeap->mHeap->base(), mRawWidth, mRawHeight, jpeg_quality, &mJpegSize))
-        LOGD("jpegConvert done! ExifWriter...");
-    else
-        LOGE("jpegConvert failed!");
+    bool videoSnapshot = slot == kVideoSnapshotSlot;
+    sp<MemPool> rawHeap;
+    sp<AshmemPool> jpegHeap;
+    int index = slot;
+    if (videoSnapshot) {
+        rawHeap = job.mSnapshotHeap;
+        jpegHeap = job.mSnapshotJpegHeap;
+        index = 0;
+    } else {
+        // With a single slot there is no copy; see initRaw().
+        if (mEncodeHeap != NULL)
+            rawHeap = mEncodeHeap;
+        else
+            rawHeap = mRawHeap;
+        jpegHeap = mJpegHeap;
+    }
+    if (rawHeap == NULL || jpegHeap == NULL) {
+        LOGE("encodeJpeg: heaps went away, dropping the picture");
+        if (videoSnapshot)
+            videoSnapshotDropped();
+        return;
+    }
+
+    uint8_t *raw = (uint8_t *)rawHeap->mHeap->base() +
+                   index * rawHeap->mBufferSize;
+    uint8_t *jpeg = (uint8_t *)jpegHeap->mHeap->base() +
+                    index * jpegHeap->mBufferSize;
+    uint32_t size = 0;
+
+    nsecs_t encodeStart = systemTime();
+    if (!videoSnapshot)
+        mCaptureStages[CAPTURE_ENCODE_START].add(encodeStart -
+                                                 job.mRawReadyTime);
+
+    int jpeg_quality = params.getInt("jpeg-quality");
+    uint32_t room = jpegHeap->mBufferSize - kJpegExifRoom;
+    size = room;
+    bool encoded = yuv420_save2jpeg(jpeg, raw, job.mWidth, job.mHeight,
+                                    jpeg_quality, &size);
+    if (!encoded) {
+        // Busier than predicted.  Encode again into a heap of the size the
+        // picture turned out to need; the next slots will be bigger.
+        LOGW("encodeJpeg: %u byte picture does not fit in %u bytes",
+             size, room);
+        mJpegOverflows++;
+        recordJpegSize(job.mWidth, job.mHeight, jpeg_quality, size);
+        sp<AshmemPool> overflowHeap =
+            // libjpeg wants a byte to spare after the last one it writes.
+            new AshmemPool(ROUND_TO_PAGE(size + 1 + kJpegExifRoom), 1, 0, 0,
+                           "jpeg overflow");
+        if (overflowHeap->initialized()) {
+            jpegHeap = overflowHeap;
+            index = 0;
+            jpeg = (uint8_t *)jpegHeap->mHeap->base();
+            size = jpegHeap->mBufferSize - kJpegExifRoom;
+            encoded = yuv420_save2jpeg(jpeg, raw, job.mWidth, job.mHeight,
+                                       jpeg_quality, &size);
+        }
+    }
+    if (!encoded) {
+        LOGE("jpegConvert failed, dropping the picture");
+        if (videoSnapshot)
+            videoSnapshotDropped();
+        return;
+    }
+    LOGD("jpegConvert done! ExifWriter...");
+    recordJpegSize(job.mWidth, job.mHeight, jpeg_quality, size);
+    nsecs_t encodeEnd = systemTime();
+
+    exif_lock.lock();
+    writeExif(jpeg, jpeg, size, &size, rotation, npt);
+    exif_lock.unlock();
+    nsecs_t exifDone = systemTime();
+
+    if (videoSnapshot) {
+        // Asked for explicitly, so sent whether or not still captures
+        // currently have CAMERA_MSG_COMPRESSED_IMAGE enabled.
+        sp<MemoryBase> buffer = new MemoryBase(jpegHeap->mHeap, 0, size);
+        mDataCb(CAMERA_MSG_COMPRESSED_IMAGE, buffer, mCallbackCookie);
+        mVideoSnapshotLatency.add(systemTime() - job.mRequestTime);
+        LOGD("encodeJpeg: video snapshot of %d bytes delivered", size);
+        return;
+    }
+
+    mCaptureStages[CAPTURE_ENCODE_END].add(encodeEnd - encodeStart);
+    mCaptureStages[CAPTURE_EXIF_DONE].add(exifDone - encodeEnd);
+
+    mJpegSize = size;
+    sp<MemoryBase> delivered =
+        receiveJpegPicture(jpegHeap->mHeap, index * jpegHeap->mBufferSize);
+    if (jpegHeap == mJpegHeap) {
+        Mutex::Autolock lock(&mEncodeLock);
+        mJpegDelivered[slot] = delivered;
+    }
+
+    nsecs_t now = systemTime();
+    mCaptureStages[CAPTURE_DELIVERED].add(now - exifDone);
+    mShotLatency.add(now - job.mRequestTime);
+    if (job.mShot == 0)
+        mShutterToJpeg.add(now - job.mRequestTime);
+    if (job.mBurstCount > 1 && job.mShot == job.mBurstCount - 1 &&
+        now > job.mBurstStart) {
+        mLastBurstShots = job.mBurstCount;
+        mLastBurstDuration = now - job.mBurstStart;
+        LOGI("burst of %d shots done in %lld ms (%lld.%02lld shots/s)",
+             mLastBurstShots, mLastBurstDuration / 1000000,
+             mLastBurstShots * 1000000000LL / mLastBurstDuration,
+             mLastBurstShots * 100000000000LL / mLastBurstDuration % 100);
+    }
+}
+
+// Takes the next frame of a noise reduction group off the encode queue.
+// Returns the slot holding the finished average once the group's last
+// frame is in, -1 until then.
+int QualcommCameraHardware::mergeNoiseReductionFrame(int slot,
+                                                     const EncodeJob &job)
+{
+    int width = job.mWidth;
+    int height = job.mHeight;
+    uint8_t *frame = (uint8_t *)mEncodeHeap->mHeap->base() +
+                     slot * mEncodeHeap->mBufferSize;
+    nsecs_t start = systemTime();
+
+    if (job.mShot == 0) {
+        // Left over from a group that lost a frame.
+        resetNoiseReduction();
+
+        // The first frame is the reference and becomes the average; its
+        // projections are kept from before anything is blended in.
+        mNrReference = (uint32_t *)malloc((width + height) * sizeof(uint32_t));
+        if (!mNrReference) {
+            LOGE("mergeNoiseReductionFrame: out of memory, not merging");
+            return slot;
+        }
+        luma_projections(frame, width, height,
+                         mNrReference, mNrReference + width);
+        mNrSlot = slot;
+        mNrFramesMerged = 1;
+        mNrMergeCost.add(systemTime() - start);
+        return -1;
+    }
+
+    if (mNrSlot < 0) {
+        // The reference could not be set up; this frame gets nothing.
+        releaseEncodeSlot(slot);
+        return -1;
+    }
+
+    uint32_t *projection =
+        (uint32_t *)malloc((width + height) * sizeof(uint32_t));
+    if (projection) {
+        luma_projections(frame, width, height,
+                         projection, projection + width);
+        // Even shifts keep the chroma plane on the same grid.
+        int dx = projection_shift(mNrReference, projection, width,
+                                  kNrMaxShift) & ~1;
+        int dy = projection_shift(mNrReference + width, projection + width,
+                                  height, kNrMaxShift) & ~1;
+        free(projection);
+
+        mNrFramesMerged++;
+        uint8_t *average = (uint8_t *)mEncodeHeap->mHeap->base() +
+                           mNrSlot * mEncodeHeap->mBufferSize;
+        yuv420sp_merge(average, frame, width, height, dx, dy,
+                       256 / mNrFramesMerged);
+        LOGD("mergeNoiseReductionFrame: frame %d/%d shifted by (%d, %d)",
+             job.mShot + 1, job.mMergeFrames, dx, dy);
+    }
+    else LOGE("mergeNoiseReductionFrame: out of memory, dropping frame");
+    releaseEncodeSlot(slot);
+    mNrMergeCost.add(systemTime() - start);
+
+    if (job.mShot < job.mMergeFrames - 1)
+        return -1;
+
+    int average = mNrSlot;
+    mNrSlot = -1;
+    free(mNrReference);
+    mNrReference = NULL;
+    return average;
+}
+
+void QualcommCameraHardware::resetNoiseReduction()
+{
+    if (mNrSlot >= 0) {
+        LOGW("resetNoiseReduction: dropping an incomplete average");
+        releaseEncodeSlot(mNrSlot);
+        mNrSlot = -1;
+    }
+    free(mNrReference);
+    mNrReference = NULL;
+    mNrFramesMerged = 0;
+}
+
+bool QualcommCameraHardware::startEncodeThread()
+{
+    if (mEncodeThreadRunning)
+        return true;
+
+    mEncodeQueue.clear();
+    for (int i = 0; i <= kVideoSnapshotSlot; i++)
+        mEncodeSlotBusy[i] = false;
+    mEncodeThreadExit = false;
+    mEncodeThreadRunning = !pthread_create(&mEncodeThread,
+                                           NULL,
+                                           jpeg_encoder_thread,
+                                           NULL);
+    if (!mEncodeThreadRunning)
+        LOGE("startEncodeThread: could not create the jpeg thread");
+    return mEncodeThreadRunning;
+}
+
+// Lets the encode thread drain whatever is queued, then joins it.
+void QualcommCameraHardware::stopEncodeThread()
+{
+    if (!mEncodeThreadRunning)
+        return;
+
+    mEncodeLock.lock();
+    mEncodeThreadExit = true;
+    mEncodeCondition.broadcast();
+    mEncodeLock.unlock();
+
+    LOGD("Stopping the jpeg thread");
+    if (pthread_join(mEncodeThread, NULL))
+        LOGE("jpeg_thread exit failure: %s", strerror(errno));
+    mEncodeThreadRunning = false;
+}
+
+// Blocks until one of the mEncodeSlots raw copies is free; this is what
+// bounds the number of shots in flight during a burst.
+int QualcommCameraHardware::acquireEncodeSlot()
+{
+    Mutex::Autolock lock(&mEncodeLock);
+    for (;;) {
+        if (!mEncodeThreadRunning || mEncodeThreadExit)
+            return -1;
+        // As many as initRaw() budgeted, not necessarily mEncodeSlots.
+        int slots = mJpegHeap != NULL ? mJpegHeap->mNumBuffers : 0;
+        bool pinned = false;
+        for (int i = 0; i < slots; i++) {
+            if (mEncodeSlotBusy[i])
+                continue;
+            // The client may still be copying the last JPEG out of this
+            // slot; the only reference left once it is done is ours.
+            if (mJpegDelivered[i] != NULL &&
+                mJpegDelivered[i]->getStrongCount() > 1) {
+                pinned = true;
+                continue;
+            }
+            mJpegDelivered[i].clear();
+            mEncodeSlotBusy[i] = true;
+            return i;
+        }
+        LOGD("acquireEncodeSlot: all %d slots busy, waiting", slots);
+        // Nothing signals a client letting go of a JPEG, so poll for that.
+        if (pinned)
+            mEncodeCondition.waitRelative(mEncodeLock, milliseconds(10));
+        else
+            mEncodeCondition.wait(mEncodeLock);
+    }
+}
+
+void QualcommCameraHardware::queueEncodeJob(int slot, const EncodeJob &job)
+{
+    Mutex::Autolock lock(&mEncodeLock);
+    mEncodeJobs[slot] = job;
+    mEncodeQueue.push(slot);
+    mEncodeCondition.broadcast();
+}
+
+void QualcommCameraHardware::releaseEncodeSlot(int slot)
+{
+    Mutex::Autolock lock(&mEncodeLock);
+    mEncodeSlotBusy[slot] = false;
+    mEncodeCondition.broadcast();
+}
+
+// Called with mLock held, from sendCommand().
+status_t QualcommCameraHardware::takeVideoSnapshot()
+{
+    if (!mCameraRecording || !mCameraRunning) {
+        LOGE("takeVideoSnapshot: not recording");
+        return INVALID_OPERATION;
+    }
+
+    int frameSize = mPreviewWidth * mPreviewHeight * 3/2;
+    if (mPreviewHeap == NULL || mPreviewHeap->mFrameSize != frameSize) {
+        LOGE("takeVideoSnapshot: preview ring does not match preview size");
+        return INVALID_OPERATION;
+    }
+
+    {
+        Mutex::Autolock lock(&mEncodeLock);
+        if (mEncodeSlotBusy[kVideoSnapshotSlot]) {
+            LOGW("takeVideoSnapshot: previous video snapshot still running");
+            return INVALID_OPERATION;
+        }
+    }
+
+    if (mVideoSnapshotHeap == NULL ||
+        mVideoSnapshotHeap->mFrameSize != frameSize) {
+        sp<AshmemPool> rawHeap = new AshmemPool(frameSize, 1, frameSize, 0,
+                                                "video snapshot");
+        int jpegSize = predictJpegSize(mPreviewWidth, mPreviewHeight,
+                                       mParameters.getInt("jpeg-quality"));
+        sp<AshmemPool> jpegHeap = new AshmemPool(jpegSize, 1, 0, 0,
+                                                 "video snapshot jpeg");
+        if (!rawHeap->initialized() || !jpegHeap->initialized()) {
+            LOGE("takeVideoSnapshot: could not allocate heaps");
+            return NO_MEMORY;
+        }
+        Mutex::Autolock lock(&mEncodeLock);
+        mVideoSnapshotHeap = rawHeap;
+        mVideoSnapshotJpegHeap = jpegHeap;
+    }
+
+    // The last snapshot is done with, but its thread may not be gone yet.
+    reapVideoSnapshotThread();
+
+    Mutex::Autolock lock(&mEncodeLock);
+    EncodeJob &job = mEncodeJobs[kVideoSnapshotSlot];
+    job.mShot = 0;
+    job.mBurstCount = 1;
+    job.mWidth = mPreviewWidth;
+    job.mHeight = mPreviewHeight;
+    job.mRequestTime = systemTime();
+    job.mRawReadyTime = 0;
+    job.mBurstStart = job.mRequestTime;
+    job.mMergeFrames = 1;
+    job.mParameters = mParameters;
+    job.mSnapshotHeap = mVideoSnapshotHeap;
+    job.mSnapshotJpegHeap = mVideoSnapshotJpegHeap;
+    mEncodeSlotBusy[kVideoSnapshotSlot] = true;
+    mVideoSnapshotPending = true;
+    return NO_ERROR;
+}
+
+void QualcommCameraHardware::runVideoSnapshotThread(void *data)
+{
+    LOGD("runVideoSnapshotThread E");
+
+    // This thread ends after the one picture, so its priority is never
+    // raised again.
+    if (setpriority(PRIO_PROCESS, 0, ANDROID_PRIORITY_BACKGROUND) < 0)
+        LOGW("runVideoSnapshotThread: could not drop priority: %s",
+             strerror(errno));
+
+    EncodeJob job;
+    {
+        Mutex::Autolock lock(&mEncodeLock);
+        job = mEncodeJobs[kVideoSnapshotSlot];
+        mEncodeJobs[kVideoSnapshotSlot].mSnapshotHeap.clear();
+        mEncodeJobs[kVideoSnapshotSlot].mSnapshotJpegHeap.clear();
+    }
+    encodeJpeg(kVideoSnapshotSlot, job);
+    releaseEncodeSlot(kVideoSnapshotSlot);
+
+    LOGD("runVideoSnapshotThread X");
+}
+
+void *video_snapshot_thread(void *user)
+{
+    LOGV("video_snapshot_thread E");
+    sp<QualcommCameraHardware> obj = QualcommCameraHardware::getInstance();
+    if (obj != 0) {
+        obj->runVideoSnapshotThread(user);
+    }
+    else LOGW("not starting video snapshot thread: the object went away!");
+    LOGV("video_snapshot_thread X");
+    return NULL;
+}
+
+// Runs wherever the preview frame is delivered: copies the frame out and
+// leaves the rest to a video snapshot thread.
+void QualcommCameraHardware::captureVideoSnapshot(int slot)
+{
+    sp<AshmemPool> heap;
+    EncodeJob job;
+    {
+        Mutex::Autolock lock(&mEncodeLock);
+        if (!mVideoSnapshotPending)
+            return;
+        mVideoSnapshotPending = false;
+        job = mEncodeJobs[kVideoSnapshotSlot];
+        heap = job.mSnapshotHeap;
+    }
+
+    if (heap == NULL || heap->mFrameSize != mPreviewHeap->mFrameSize) {
+        LOGW("captureVideoSnapshot: dropped");
+        {
+            Mutex::Autolock lock(&mEncodeLock);
+            mEncodeJobs[kVideoSnapshotSlot].mSnapshotHeap.clear();
+            mEncodeJobs[kVideoSnapshotSlot].mSnapshotJpegHeap.clear();
+        }
+        releaseEncodeSlot(kVideoSnapshotSlot);
+        videoSnapshotDropped();
+        return;
+    }
+
+    nsecs_t start = systemTime();
+    memcpy(heap->mHeap->base(),
+           (uint8_t *)mPreviewHeap->mHeap->base() +
+               mPreviewHeap->mBufferSize * slot,
+           heap->mFrameSize);
+    job.mRawReadyTime = systemTime();
+    mVideoSnapshotCopy.add(job.mRawReadyTime - start);
+
+    mVideoSnapshots++;
+
+    mEncodeLock.lock();
+    mEncodeJobs[kVideoSnapshotSlot] = job;
+    mVideoSnapshotThreadRunning = !pthread_create(&mVideoSnapshotThread,
+                                                  NULL,
+                                                  video_snapshot_thread,
+                                                  NULL);
+    bool started = mVideoSnapshotThreadRunning;
+    if (!started) {
+        mEncodeJobs[kVideoSnapshotSlot].mSnapshotHeap.clear();
+        mEncodeJobs[kVideoSnapshotSlot].mSnapshotJpegHeap.clear();
+        mEncodeSlotBusy[kVideoSnapshotSlot] = false;
+        mEncodeCondition.broadcast();
+    }
+    mEncodeLock.unlock();
+
+    if (!started) {
+        LOGE("captureVideoSnapshot: could not create the encode thread");
+        videoSnapshotDropped();
+    }
+}
 
-    writeExif(mJpegHeap->mHeap->base(), mJpegHeap->mHeap->base(), mJpegSize,
-            &mJpegSize, rotation, npt);
+void QualcommCameraHardware::reapVideoSnapshotThread()
+{
+    mEncodeLock.lock();
+    bool running = mVideoSnapshotThreadRunning;
+    pthread_t thread = mVideoSnapshotThread;
+    mVideoSnapshotThreadRunning = false;
+    mEncodeLock.unlock();
 
-    receiveJpegPicture();
+    if (!running)
+        return;
+    // A client may call back in from the picture callback itself.
+    if (pthread_equal(pthread_self(), thread))
+        pthread_detach(thread);
+    else if (pthread_join(thread, NULL))
+        LOGE("video_snapshot_thread exit failure: %s", strerror(errno));
+}
+
+// A snapshot already captured keeps its heaps alive, through its job,
+// until it is delivered; one still waiting for a frame is dropped.
+void QualcommCameraHardware::releaseVideoSnapshotHeaps()
+{
+    mEncodeLock.lock();
+    bool dropped = mVideoSnapshotPending;
+    if (dropped) {
+        mVideoSnapshotPending = false;
+        mEncodeJobs[kVideoSnapshotSlot].mSnapshotHeap.clear();
+        mEncodeJobs[kVideoSnapshotSlot].mSnapshotJpegHeap.clear();
+        mEncodeSlotBusy[kVideoSnapshotSlot] = false;
+        mEncodeCondition.broadcast();
+    }
+    mVideoSnapshotHeap.clear();
+    mVideoSnapshotJpegHeap.clear();
+    mEncodeLock.unlock();
+
+    if (dropped) {
+        LOGW("releaseVideoSnapshotHeaps: video snapshot dropped");
+        videoSnapshotDropped();
+    }
+}
+
+// The client asked for the picture, so tell it that none is coming.
+void QualcommCameraHardware::videoSnapshotDropped()
+{
+    if (mMsgEnabled & CAMERA_MSG_ERROR)
+        mNotifyCb(CAMERA_MSG_ERROR, CAMERA_ERROR_UNKNOWN, 0, mCallbackCookie);
 }
 
 bool QualcommCameraHardware::initPreview()
 {
-    // See comments in deinitPreview() for why we have to wait for the frame
-    // thread here, and why we can't use pthread_join().
     LOGD("initPreview E: preview size=%dx%d", mPreviewWidth, mPreviewHeight);
 
-    mFrameThreadWaitLock.lock();
-    while (mFrameThreadRunning) {
-        LOGD("initPreview: waiting for old frame thread to complete.");
-        mFrameThreadWait.wait(mFrameThreadWaitLock);
-        LOGD("initPreview: old frame thread completed.");
-    }
-    mFrameThreadWaitLock.unlock();
+    // An old frame thread only survives here if deinitPreview() was
+    // skipped; stopping it is a plain join.
+    stopFrameThread();
 
     mSnapshotThreadWaitLock.lock();
     while (mSnapshotThreadRunning) {
@@ -883,16 +1871,56 @@ bool QualcommCameraHardware::initPreview()
     }
     mSnapshotThreadWaitLock.unlock();
 
+    mPreviewBufferCount = preview_buffer_count();
+    if (checkMemoryPressure() &&
+        mPreviewBufferCount > kPreviewBufferCountMin) {
+        LOGW("initPreview: memory low, %d preview buffers instead of %d",
+             kPreviewBufferCountMin, mPreviewBufferCount);
+        mPreviewBufferCount = kPreviewBufferCountMin;
+        mMemoryTrims++;
+    }
+
+    // Each ring slot gets its own page-aligned region of the heap.
     mPreviewFrameSize = mPreviewWidth * mPreviewHeight * 3/2;
-    mPreviewHeap = new PreviewPmemPool(mCameraControlFd,
-                                       mPreviewWidth * mPreviewHeight * 2,
-                                       kPreviewBufferCount,
-                                       mPreviewFrameSize,
-                                       0,
-                                       "preview");
-
-    if (!mPreviewHeap->initialized()) {
-        mPreviewHeap.clear();
+    int bufferSize = ROUND_TO_PAGE(mPreviewFrameSize);
+    sp<PreviewPmemPool> heap = mPreviewHeap;
+    if (heap != NULL &&
+        heap->mBufferSize == bufferSize &&
+        heap->mNumBuffers == mPreviewBufferCount &&
+        heap->mFrameSize == (int)mPreviewFrameSize) {
+        // Allocated while the camera was being opened.
+        LOGD("initPreview: using preallocated preview heap");
+    } else {
+        heap = new PreviewPmemPool(mCameraControlFd,
+                                   bufferSize,
+                                   mPreviewBufferCount,
+                                   mPreviewFrameSize,
+                                   0,
+                                   "preview");
+    }
+
+    if (!heap->initialized() && mRawInitialized) {
+        // The resident snapshot pools may be what is crowding pmem out;
+        // give them back and try once more.
+        releaseSnapshotPools("preview heap allocation failed");
+        heap = new PreviewPmemPool(mCameraControlFd,
+                                   bufferSize,
+                                   mPreviewBufferCount,
+                                   mPreviewFrameSize,
+                                   0,
+                                   "preview");
+    }
+
+    if (!heap->initialized())
+        heap.clear();
+
+    {
+        // releaseRecordingFrame() may still be handing back frames of the
+        // previous session.
+        Mutex::Autolock rLock(mRecordFrameLock);
+        mPreviewHeap = heap;
+    }
+    if (mPreviewHeap == NULL) {
         LOGE("initPreview X: could not initialize preview heap.");
         return false;
     }
@@ -902,10 +1930,10 @@ bool QualcommCameraHardware::initPreview()
     // (sizeof(mDimension) == 0x70) found in assembled codes
     // element type was unsigned long?
     if (native_set_dimension(&mDimension)) {
-        for (int cnt = 0; cnt < kPreviewBufferCount; cnt++) {
+        for (int cnt = 0; cnt < mPreviewBufferCount; cnt++) {
             frames[cnt].fd = mPreviewHeap->mHeap->getHeapID();
-            // vaddrs(buffer) of 4 frames not changed in Donut dmesg
-            frames[cnt].buffer = (uint32_t)mPreviewHeap->mHeap->base();
+            frames[cnt].buffer = (uint32_t)mPreviewHeap->mHeap->base() +
+                                 mPreviewHeap->mBufferSize * cnt;
             frames[cnt].y_off = 0;
             frames[cnt].cbcr_off = mPreviewWidth * mPreviewHeight;
 
@@ -915,30 +1943,25 @@ bool QualcommCameraHardware::initPreview()
             }
 
             frames[cnt].path = MSM_FRAME_ENC;
+            mPreviewSlotRefs[cnt] = 0;
+            mRecordFrameHeld[cnt] = false;
 
-            activeBuffer = (cnt != kPreviewBufferCount - 1) ? 1 : 0;
+            // The last buffer starts out inactive as a spare for the VFE.
+            activeBuffer = (cnt != mPreviewBufferCount - 1) ? 1 : 0;
 
             // returned type should be bool, verified from assembled codes
             native_register_preview_bufs(mCameraControlFd,
                                          &mDimension,
                                          &frames[cnt],
                                          activeBuffer);
-
-            if (cnt == kPreviewBufferCount - 1) {
-                mFrameThreadRunning = !pthread_create(&mFrameThread,
-                                                      NULL,
-                                                      cam_frame_click,
-                                                      &frames[cnt]);
-                if (mFrameThreadRunning)
-                    LOGD("Preview thread created");
-                else
-                    LOGE("pthread_create error");
-            }
         }
+        mDisplayedPreviewSlot = -1;
+
+        startFrameThread(&frames[0]);
     } else
         LOGE("native_set_dimension failed");
 
-    return mFrameThreadRunning;
+    return mFrameThreadStarted;
 }
 
 void QualcommCameraHardware::deinitPreview(void)
@@ -947,23 +1970,408 @@ void QualcommCameraHardware::deinitPreview(void)
 
     // LINK_camframe_terminate() never been used
 
-    if (mFrameThreadRunning) {
-        // Send a exit signal to stop the frame thread
-        if (!pthread_kill(mFrameThread, SIGUSR1)) {
-            LOGD("terminate frame_thread successfully");
-            mFrameThreadRunning = false;
-        } else
-            LOGE("frame_thread doesn't exist");
-    }
+    stopFrameThread();
+    stopSoftZoomThread();
+
+    free(mZoomScratch);
+    mZoomScratch = NULL;
+    mZoomScratchSize = 0;
 
     LOGD("Unregister preview buffers");
-    for (int cnt = 0; cnt < kPreviewBufferCount; ++cnt) {
+    for (int cnt = 0; cnt < mPreviewBufferCount; ++cnt) {
         native_unregister_preview_bufs(mCameraControlFd,
                                        &mDimension,
                                        &frames[cnt]);
     }
-    
-    mPreviewHeap.clear();
+
+    {
+        Mutex::Autolock rLock(mRecordFrameLock);
+        Mutex::Autolock lock(mPreviewSlotLock);
+        for (int cnt = 0; cnt < mPreviewBufferCount; ++cnt) {
+            mPreviewSlotRefs[cnt] = 0;
+            mRecordFrameHeld[cnt] = false;
+        }
+        mRecordFramesHeld = 0;
+        mDisplayedPreviewSlot = -1;
+
+        // Under mRecordFrameLock, as releaseRecordingFrame() reads it from
+        // the recorder's thread.
+        mPreviewHeap.clear();
+    }
+}
+
+// Maps a frame handed back by MSM_CAM_IOCTL_GETFRAME to its ring slot.
+int QualcommCameraHardware::previewSlotFor(const struct msm_frame_t *frame) const
+{
+    if (mPreviewHeap == NULL)
+        return -1;
+
+    unsigned long base = (unsigned long)mPreviewHeap->mHeap->base();
+    if (frame->buffer < base)
+        return -1;
+
+    int slot = (frame->buffer - base) / mPreviewHeap->mBufferSize;
+    if (slot >= mPreviewBufferCount || frames[slot].buffer != frame->buffer)
+        return -1;
+
+    return slot;
+}
+
+void QualcommCameraHardware::acquirePreviewSlot(int slot)
+{
+    Mutex::Autolock lock(mPreviewSlotLock);
+    mPreviewSlotRefs[slot]++;
+}
+
+// Drops one consumer reference; the buffer goes back to the VFE once nobody
+// holds it any more.
+void QualcommCameraHardware::releasePreviewSlot(int slot)
+{
+    Mutex::Autolock lock(mPreviewSlotLock);
+
+    if (mPreviewSlotRefs[slot] <= 0) {
+        LOGE("releasePreviewSlot: slot %d is not held", slot);
+        return;
+    }
+
+    if (--mPreviewSlotRefs[slot] == 0) {
+        if (ioctl(framefd, MSM_CAM_IOCTL_RELEASE_FRAMEE_BUFFER, &frames[slot]) < 0)
+            LOGE("MSM_CAM_IOCTL_RELEASE_FRAME_BUFFER error %s", strerror(errno));
+    }
+}
+
+// Called from setParameters() once the preview size is known.
+void QualcommCameraHardware::setPreviewConversion(int format)
+{
+    Mutex::Autolock lock(mConvertLock);
+
+    int size = 0;
+    if (format == PREVIEW_FORMAT_RGB565)
+        size = mPreviewWidth * mPreviewHeight * 2;
+    else if (format == PREVIEW_FORMAT_LUMA_HALF)
+        size = (mPreviewWidth / 2) * (mPreviewHeight / 2);
+
+    if (size == 0) {
+        mConvertHeap.clear();
+    } else if (mConvertHeap == NULL || mConvertHeap->mFrameSize != size) {
+        mConvertHeap = new AshmemPool(size,
+                                      kConvertBufferCount,
+                                      size,
+                                      0,
+                                      "preview convert");
+        if (!mConvertHeap->initialized()) {
+            LOGE("could not allocate the preview conversion heap, "
+                 "falling back to yuv420sp");
+            mConvertHeap.clear();
+            format = PREVIEW_FORMAT_YUV420SP;
+        }
+    }
+
+    if (format != mPreviewFormat)
+        mPreviewConvertCost.reset();
+    mPreviewFormat = format;
+    mConvertWidth = mPreviewWidth;
+    mConvertHeight = mPreviewHeight;
+    mConvertSlot = 0;
+}
+
+// Called from setParameters() once the preview size is known.
+void QualcommCameraHardware::setSecondaryPreview(int decimation, int shift)
+{
+    Mutex::Autolock lock(mConvertLock);
+
+    int width = mPreviewWidth >> shift;
+    int height = mPreviewHeight >> shift;
+    int size = width * height;
+
+    if (decimation == 0) {
+        mSecondaryHeap.clear();
+    } else if (mSecondaryHeap == NULL || mSecondaryHeap->mFrameSize != size) {
+        mSecondaryHeap = new AshmemPool(size,
+                                        kSecondaryBufferCount,
+                                        size,
+                                        0,
+                                        "preview secondary");
+        if (!mSecondaryHeap->initialized()) {
+            LOGE("could not allocate the secondary preview heap, "
+                 "stream disabled");
+            mSecondaryHeap.clear();
+            decimation = 0;
+        }
+    }
+
+    if (decimation != mSecondaryDecimation || shift != mSecondaryShift) {
+        mSecondaryCost.reset();
+        mSecondaryFrameCount = 0;
+    }
+    mSecondaryDecimation = decimation;
+    mSecondaryShift = shift;
+    mSecondaryWidth = width;
+    mSecondaryHeight = height;
+}
+
+// Returns the next secondary stream buffer if this frame is due for one,
+// NULL otherwise.
+sp<MemoryBase> QualcommCameraHardware::secondaryPreviewFrame(int slot)
+{
+    Mutex::Autolock lock(mConvertLock);
+
+    if (mSecondaryHeap == NULL ||
+        mSecondaryFrameCount++ % mSecondaryDecimation != 0)
+        return NULL;
+
+    // As with conversion, wait for the ring to pick up a new preview size.
+    int width = mSecondaryWidth << mSecondaryShift;
+    int height = mSecondaryHeight << mSecondaryShift;
+    if (mPreviewHeap->mFrameSize != width * height * 3/2)
+        return NULL;
+
+    nsecs_t start = systemTime();
+    const uint8_t *src = (const uint8_t *)mPreviewHeap->mHeap->base() +
+                         mPreviewHeap->mBufferSize * slot;
+    int index = mSecondarySlot;
+    mSecondarySlot = (mSecondarySlot + 1) % kSecondaryBufferCount;
+    uint8_t *dst = (uint8_t *)mSecondaryHeap->mHeap->base() +
+                   mSecondaryHeap->mBufferSize * index;
+
+    yuv420sp_to_luma_box(src, dst, width, height, mSecondaryShift);
+
+    mSecondaryCost.add(systemTime() - start);
+    mSecondaryFramesSent++;
+    return mSecondaryHeap->mBuffers[index];
+}
+
+// Runs on the soft zoom thread, before the slot is handed to anyone.
+void QualcommCameraHardware::softZoomPreviewFrame(int slot)
+{
+    int ratio = mSoftZoomRatio;
+    int frameSize = mPreviewHeap->mFrameSize;
+
+    // A new preview size reaches the ring only on the next startPreview().
+    if (frameSize != mPreviewWidth * mPreviewHeight * 3/2)
+        return;
+
+    if (mZoomScratchSize != frameSize) {
+        free(mZoomScratch);
+        mZoomScratch = (uint8_t *)malloc(frameSize);
+        mZoomScratchSize = mZoomScratch ? frameSize : 0;
+        if (!mZoomScratch) {
+            LOGE("softZoomPreviewFrame: out of memory");
+            return;
+        }
+    }
+
+    nsecs_t start = systemTime();
+    uint8_t *frame = (uint8_t *)mPreviewHeap->mHeap->base() +
+                     mPreviewHeap->mBufferSize * slot;
+    memcpy(mZoomScratch, frame, frameSize);
+    yuv420sp_zoom(mZoomScratch, frame, mPreviewWidth, mPreviewHeight, ratio);
+    mSoftZoomPreviewCost[mPreviewSizeIndex].add(systemTime() - start);
+}
+
+void *soft_zoom_thread(void *user)
+{
+    LOGV("soft_zoom_thread E");
+    sp<QualcommCameraHardware> obj = QualcommCameraHardware::getInstance();
+    if (obj != 0) {
+        obj->runSoftZoomThread(user);
+    }
+    else LOGW("not starting soft zoom thread: the object went away!");
+    LOGV("soft_zoom_thread X");
+    return NULL;
+}
+
+// Called on the frame thread.  Returns false if the frame thread should
+// deliver the slot itself.
+bool QualcommCameraHardware::queueSoftZoomFrame(int slot, nsecs_t captureTime)
+{
+    Mutex::Autolock lock(mSoftZoomLock);
+
+    if (mSoftZoomRatio <= 100 && !mSoftZoomDelivering &&
+        mSoftZoomQueuedSlot < 0)
+        return false;
+
+    if (!mSoftZoomThreadRunning) {
+        mSoftZoomThreadExit = false;
+        mSoftZoomThreadRunning = !pthread_create(&mSoftZoomThread, NULL,
+                                                 soft_zoom_thread, NULL);
+        if (!mSoftZoomThreadRunning) {
+            LOGE("queueSoftZoomFrame: could not create the soft zoom thread");
+            return false;
+        }
+    }
+
+    // The thread is still busy with an older frame: drop the one it has
+    // not started on yet rather than fall further behind.
+    if (mSoftZoomQueuedSlot >= 0) {
+        releasePreviewSlot(mSoftZoomQueuedSlot);
+        mSoftZoomFramesReplaced++;
+    }
+    acquirePreviewSlot(slot);
+    mSoftZoomQueuedSlot = slot;
+    mSoftZoomQueuedTime = captureTime;
+    mSoftZoomCondition.signal();
+    return true;
+}
+
+void QualcommCameraHardware::runSoftZoomThread(void *data)
+{
+    LOGD("runSoftZoomThread E");
+
+    mSoftZoomLock.lock();
+    for (;;) {
+        while (!mSoftZoomThreadExit && mSoftZoomQueuedSlot < 0)
+            mSoftZoomCondition.wait(mSoftZoomLock);
+        if (mSoftZoomThreadExit)
+            break;
+
+        int slot = mSoftZoomQueuedSlot;
+        nsecs_t captureTime = mSoftZoomQueuedTime;
+        mSoftZoomQueuedSlot = -1;
+        mSoftZoomDelivering = true;
+        mSoftZoomLock.unlock();
+
+        // Preview may have been paused for a picture since the frame was
+        // queued.
+        if (mCameraRunning && !mPreviewPaused) {
+            if (mSoftZoomRatio > 100)
+                softZoomPreviewFrame(slot);
+            deliverPreviewFrame(slot, captureTime);
+        }
+        releasePreviewSlot(slot);
+
+        mSoftZoomLock.lock();
+        mSoftZoomDelivering = false;
+    }
+
+    if (mSoftZoomQueuedSlot >= 0) {
+        releasePreviewSlot(mSoftZoomQueuedSlot);
+        mSoftZoomQueuedSlot = -1;
+    }
+    mSoftZoomLock.unlock();
+
+    LOGD("runSoftZoomThread X");
+}
+
+// Called after the frame thread has stopped, so nothing queues behind it.
+void QualcommCameraHardware::stopSoftZoomThread()
+{
+    if (!mSoftZoomThreadRunning)
+        return;
+
+    mSoftZoomLock.lock();
+    mSoftZoomThreadExit = true;
+    mSoftZoomCondition.signal();
+    mSoftZoomLock.unlock();
+
+    if (pthread_join(mSoftZoomThread, NULL))
+        LOGE("soft_zoom_thread exit failure: %s", strerror(errno));
+    mSoftZoomThreadRunning = false;
+}
+
+// Returns a converted copy of a ring slot to hand out as
+// CAMERA_MSG_PREVIEW_CONVERTED, or NULL if there is none to send.
+sp<MemoryBase> QualcommCameraHardware::convertPreviewFrame(int slot)
+{
+    Mutex::Autolock lock(mConvertLock);
+
+    // A preview size change reaches the ring only on the next
+    // startPreview(), so until then there is nothing to convert.
+    if (mConvertHeap == NULL ||
+        mPreviewHeap->mFrameSize != mConvertWidth * mConvertHeight * 3/2)
+        return NULL;
+
+    nsecs_t start = systemTime();
+    const uint8_t *src = (const uint8_t *)mPreviewHeap->mHeap->base() +
+                         mPreviewHeap->mBufferSize * slot;
+    int index = mConvertSlot;
+    mConvertSlot = (mConvertSlot + 1) % kConvertBufferCount;
+    uint8_t *dst = (uint8_t *)mConvertHeap->mHeap->base() +
+                   mConvertHeap->mBufferSize * index;
+
+    if (mPreviewFormat == PREVIEW_FORMAT_RGB565)
+        yuv420sp_to_rgb565(src, (uint16_t *)dst, mConvertWidth, mConvertHeight);
+    else
+        yuv420sp_to_luma_half(src, dst, mConvertWidth, mConvertHeight);
+
+    mPreviewConvertCost.add(systemTime() - start);
+    return mConvertHeap->mBuffers[index];
+}
+
+bool QualcommCameraHardware::checkMemoryPressure()
+{
+    mMemoryAvailableKb = available_memory_kb();
+    mMemoryLowKb = low_memory_threshold_kb();
+    bool low = mMemoryAvailableKb >= 0 && mMemoryAvailableKb < mMemoryLowKb;
+    if (low != mMemoryLow)
+        LOGI("checkMemoryPressure: %d kB available, low at %d kB: %s",
+             mMemoryAvailableKb, mMemoryLowKb,
+             low ? "trimming camera pools" : "no longer trimming");
+    mMemoryLow = low;
+    return low;
+}
+
+// Room for one JPEG, EXIF included.  A measured size gets a quarter on top
+// for scenes busier than the ones seen so far.
+int QualcommCameraHardware::predictJpegSize(int width, int height,
+                                            int quality)
+{
+    if (quality < 0)
+        quality = 0;
+    else if (quality > 100)
+        quality = 100;
+    int band = quality / 10;
+
+    uint32_t perPixel;
+    {
+        Mutex::Autolock lock(&mEncodeLock);
+        perPixel = mJpegBytesPerPixel[band];
+    }
+    if (perPixel)
+        perPixel += perPixel / 4;
+    else
+        perPixel = jpeg_prior_bytes_per_pixel[band];
+
+    int pixels = width * height;
+    int size = (int)(((int64_t)pixels * perPixel) >> 8);
+    if (size > pixels * 3/2)
+        size = pixels * 3/2;
+    return ROUND_TO_PAGE(size + kJpegExifRoom);
+}
+
+// Called from the encode thread with every picture's compressed size.
+void QualcommCameraHardware::recordJpegSize(int width, int height,
+                                            int quality, uint32_t size)
+{
+    if (quality < 0)
+        quality = 0;
+    else if (quality > 100)
+        quality = 100;
+    uint32_t perPixel = (uint32_t)(((uint64_t)size << 8) / (width * height)) + 1;
+
+    // Up at once, down slowly: one plain scene should not take away the
+    // room the next busy one needs.
+    Mutex::Autolock lock(&mEncodeLock);
+    uint32_t &estimate = mJpegBytesPerPixel[quality / 10];
+    if (perPixel >= estimate)
+        estimate = perPixel;
+    else
+        estimate -= (estimate - perPixel) / 8;
+}
+
+// One slot per shot that can be in flight, up to burst-buffers, so a
+// single shot gets one.  Noise reduction keeps its average in one slot
+// while the next frame arrives in another, so it needs two even when
+// memory is low.
+int QualcommCameraHardware::encodeSlotBudget() const
+{
+    int least = mNrFrames > 1 ? 2 : 1;
+    if (mMemoryLow)
+        return least;
+
+    int shots = mNrFrames > 1 ? mNrFrames : mBurstCount;
+    int slots = shots < mEncodeSlots ? shots : mEncodeSlots;
+    return slots < least ? least : slots;
 }
 
 bool QualcommCameraHardware::initRaw(bool initJpegHeap)
@@ -973,13 +2381,36 @@ bool QualcommCameraHardware::initRaw(bool initJpegHeap)
     mDimension.picture_width   = mRawWidth;
     mDimension.picture_height  = mRawHeight;
     mRawSize = mRawWidth * mRawHeight * 3 / 2;
-    mJpegMaxSize = mRawWidth * mRawHeight * 3 / 2;
+    mJpegMaxSize = predictJpegSize(mRawWidth, mRawHeight,
+                                   mParameters.getInt("jpeg-quality"));
+    checkMemoryPressure();
+    int slots = encodeSlotBudget();
 
     if(!native_set_dimension(&mDimension)) {
         LOGE("initRaw X: failed to set dimension");
         return false;
     }
 
+    if (mRawInitialized) {
+        // Pools kept from the previous shot are still registered with the
+        // driver; reuse them as long as they fit this picture.
+        bool jpegFits = mJpegHeap != NULL &&
+                        mJpegHeap->mNumBuffers == slots &&
+                        mJpegHeap->mBufferSize >= mJpegMaxSize;
+        // Room well beyond the prediction is only given back when short.
+        if (jpegFits && mMemoryLow &&
+            mJpegHeap->mBufferSize > mJpegMaxSize + mJpegMaxSize / 4)
+            jpegFits = false;
+        if (mRawHeap != NULL && mRawHeap->mFrameSize == mRawSize &&
+            (!initJpegHeap || jpegFits)) {
+            mSnapshotPoolReuses++;
+            LOGD("initRaw X: reusing snapshot pools");
+            return true;
+        }
+        deinitRaw();
+    }
+    mSnapshotPoolAllocs++;
+
     if (mJpegHeap != NULL) {
         LOGD("initRaw: clearing old mJpegHeap.");
         mJpegHeap.clear();
@@ -989,7 +2420,7 @@ bool QualcommCameraHardware::initRaw(bool initJpegHeap)
 
     LOGD("initRaw: initializing mThumbHeap. with size %d", THUMBNAIL_BUFFER_SIZE);
     mThumbnailHeap =
-        new PmemPool("/dev/pmem_adsp",
+        new PmemPool(pmem_adsp_path,
                      mCameraControlFd,
                      MSM_PMEM_THUMBNAIL,
                      THUMBNAIL_BUFFER_SIZE,
@@ -1009,10 +2440,10 @@ bool QualcommCameraHardware::initRaw(bool initJpegHeap)
 
     LOGD("initRaw: initializing mRawHeap. with size %d", mRawSize);
     mRawHeap =
-        new PmemPool("/dev/pmem_camera",
+        new PmemPool(pmem_camera_path,
                      mCameraControlFd,
                      MSM_PMEM_MAINIMG,
-                     mJpegMaxSize,
+                     mRawSize,
                      kRawBufferCount,
                      mRawSize,
                      0,
@@ -1021,10 +2452,10 @@ bool QualcommCameraHardware::initRaw(bool initJpegHeap)
     if (!mRawHeap->initialized()) {
         LOGE("initRaw X failed with pmem_camera, trying with pmem_adsp");
         mRawHeap =
-            new PmemPool("/dev/pmem_adsp",
+            new PmemPool(pmem_adsp_path,
                          mCameraControlFd,
                          MSM_PMEM_MAINIMG,
-                         mJpegMaxSize,
+                         mRawSize,
                          kRawBufferCount,
                          mRawSize,
                          0,
@@ -1042,15 +2473,38 @@ bool QualcommCameraHardware::initRaw(bool initJpegHeap)
     // Jpeg
 
     if (initJpegHeap) {
-        LOGD("initRaw: initializing mJpegHeap.");
+        LOGD("initRaw: initializing mEncodeHeap and mJpegHeap, %d slots "
+             "of %d bytes.", slots, mJpegMaxSize);
+        if (mMemoryLow) {
+            LOGW("initRaw: memory low, %d encode slots", slots);
+            mMemoryTrims++;
+        }
+        // JPEGs still held by the client keep the old pool alive on their
+        // own; they no longer pin a slot of the new one.
+        {
+            Mutex::Autolock lock(&mEncodeLock);
+            for (int i = 0; i < kEncodeSlotsMax; i++)
+                mJpegDelivered[i].clear();
+        }
+        // A single slot is encoded straight from mRawHeap: the next shot
+        // cannot capture into it before the slot is released anyway.
+        if (slots > 1)
+            mEncodeHeap =
+                new AshmemPool(mRawSize,
+                               slots,
+                               mRawSize,
+                               0,
+                               "encode");
         mJpegHeap =
             new AshmemPool(mJpegMaxSize,
-                           kJpegBufferCount,
+                           slots,
                            0, // we do not know how big the picture wil be
                            0,
                            "jpeg");
 
-        if (!mJpegHeap->initialized()) {
+        if ((mEncodeHeap != NULL && !mEncodeHeap->initialized()) ||
+            !mJpegHeap->initialized() || !startEncodeThread()) {
+            mEncodeHeap.clear();
             mJpegHeap.clear();
             mRawHeap.clear();
             LOGE("initRaw X failed: error initializing mJpegHeap.");
@@ -1068,12 +2522,37 @@ void QualcommCameraHardware::deinitRaw()
 {
     LOGD("deinitRaw EX");
 
+    stopEncodeThread();
+
+    {
+        Mutex::Autolock lock(&mEncodeLock);
+        for (int i = 0; i < kEncodeSlotsMax; i++)
+            mJpegDelivered[i].clear();
+    }
     mThumbnailHeap.clear();
+    mEncodeHeap.clear();
     mJpegHeap.clear();
     mRawHeap.clear();
     mRawInitialized = false;
 }
 
+// Must be called with mLock held, so that no new snapshot can start.
+void QualcommCameraHardware::releaseSnapshotPools(const char *reason)
+{
+    if (!mRawInitialized)
+        return;
+
+    mSnapshotThreadWaitLock.lock();
+    while (mSnapshotThreadRunning) {
+        LOGD("releaseSnapshotPools: waiting for snapshot thread to complete.");
+        mSnapshotThreadWait.wait(mSnapshotThreadWaitLock);
+    }
+    mSnapshotThreadWaitLock.unlock();
+
+    LOGD("releaseSnapshotPools: %s", reason);
+    deinitRaw();
+}
+
 void QualcommCameraHardware::release()
 {
     LOGD("release E");
@@ -1091,17 +2570,15 @@ void QualcommCameraHardware::release()
     int rc;
     struct msm_ctrl_cmd_t ctrlCmd;
 
-    if (mCameraRunning) {
-        if (mMsgEnabled & CAMERA_MSG_VIDEO_FRAME) {
-            mRecordFrameLock.lock();
-            mReleasedRecordingFrame = true;
-            mRecordWait.signal();
-            mRecordFrameLock.unlock();
-        }
+    mPreviewRestartPending = false;
+    mPreviewPaused = false;
+    stopZoomThread();
+    if (mCameraRunning)
         stopPreviewInternal();
-    }
 
     if (mRawInitialized) deinitRaw();
+    releaseVideoSnapshotHeaps();
+    reapVideoSnapshotThread();
 
     LOGD("CAMERA_EXIT");
 
@@ -1118,13 +2595,6 @@ void QualcommCameraHardware::release()
     if (rc)
         LOGE("config_thread exit failure: %s", strerror(errno));
  
-    if (mJpegThreadRunning) {
-        LOGD("Stopping the jpeg thread");
-        rc = pthread_join(jpegThread, NULL);
-        if (rc)
-            LOGE("jpeg_thread exit failure: %s", strerror(errno));
-    }
-
     memset(&mDimension, 0, sizeof(mDimension));
 
     close(mCameraControlFd);
@@ -1183,6 +2653,8 @@ status_t QualcommCameraHardware::startPreviewInternal()
         return NO_ERROR;
     }
 
+    nsecs_t start = systemTime();
+
     if (!mPreviewInitialized) {
         mPreviewInitialized = initPreview();
         if (!mPreviewInitialized) {
@@ -1199,25 +2671,43 @@ status_t QualcommCameraHardware::startPreviewInternal()
         return UNKNOWN_ERROR;
     }
 
-    LOGD("startPreview X");
+    // Settings changed while preview was stopped.
+    applyDriverSettings();
+
+    mPreviewStartLatency = systemTime() - start;
+    LOGD("startPreview X (%lld us)", mPreviewStartLatency / 1000);
     return NO_ERROR;
 }
 
 status_t QualcommCameraHardware::startPreview()
 {
     Mutex::Autolock l(&mLock);
+
+    mPreviewRestartPending = false;
+    if (mPreviewPaused && mCameraRunning) {
+        LOGD("startPreview: resuming preview restarted after snapshot");
+        mPreviewPaused = false;
+        return NO_ERROR;
+    }
+    mPreviewPaused = false;
+
     return startPreviewInternal();
 }
 
 void QualcommCameraHardware::stopPreviewInternal()
 {
     LOGV("stopPreviewInternal E with mCameraRunning %d", mCameraRunning);
+
     if (mCameraRunning) {
         LOGD("Stopping preview");
+        nsecs_t start = systemTime();
         mCameraRunning = !native_stop_preview(mCameraControlFd);
         if (!mCameraRunning && mPreviewInitialized) {
             deinitPreview();
             mPreviewInitialized = false;
+            mPreviewStopLatency = systemTime() - start;
+            LOGD("stopPreviewInternal: stopped in %lld us",
+                 mPreviewStopLatency / 1000);
         }
         else LOGE("stopPreviewInternal: failed to stop preview");
     }
@@ -1232,9 +2722,17 @@ void QualcommCameraHardware::stopPreview()
     if(mMsgEnabled & CAMERA_MSG_VIDEO_FRAME)
         return;
 
+    mPreviewRestartPending = false;
+    mPreviewPaused = false;
+
     if (mCameraRunning)
         stopPreviewInternal();
 
+    // Like after a shot, the pools stay for the next takePicture() unless
+    // the system is short of memory; release() frees them either way.
+    if (checkMemoryPressure())
+        releaseSnapshotPools("preview stopped, memory low");
+
     LOGD("stopPreview: X");
 }
 
@@ -1257,19 +2755,79 @@ void QualcommCameraHardware::runSnapshotThread(void *data)
 {
     LOGD("runSnapshotThread E");
 
-    if (native_start_snapshot(mCameraControlFd))
-        receiveRawPicture();
-    else
-        LOGE("main: native_start_snapshot failed!");
+    bool encode = mJpegHeap != NULL &&
+                  (mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE);
+    bool merge = encode && mNrFrames > 1;
+    int count = merge ? mNrFrames : mBurstCount;
+    nsecs_t interval = merge ? 0 : mBurstInterval;
+    nsecs_t nextShot = mShutterRequestTime;
+
+    for (int shot = 0; shot < count; shot++) {
+        nsecs_t now = systemTime();
+        if (nextShot > now)
+            usleep((nextShot - now) / 1000);
+
+        int slot = -1;
+        if (encode && (slot = acquireEncodeSlot()) < 0) {
+            LOGE("runSnapshotThread: no encode slot for shot %d", shot);
+            break;
+        }
+
+        nsecs_t requestTime = shot ? systemTime() : mShutterRequestTime;
+        nextShot = requestTime + interval;
+
+        if (!native_start_snapshot(mCameraControlFd)) {
+            LOGE("main: native_start_snapshot failed!");
+            if (slot >= 0)
+                releaseEncodeSlot(slot);
+            break;
+        }
+        receiveRawPicture(slot, shot, count, merge, requestTime);
+    }
 
     mSnapshotThreadWaitLock.lock();
     mSnapshotThreadRunning = false;
     mSnapshotThreadWait.signal();
     mSnapshotThreadWaitLock.unlock();
 
+    // The encode thread has its own copy of every shot, or with a single
+    // slot owns mRawHeap until it releases it, so the sensor can go back
+    // to preview now rather than after the JPEG callback.  This is
+    // done only after signalling completion above, as the paths that wait
+    // for this thread do so with mLock held.
+    restartPreviewAfterSnapshot((int)(intptr_t)data);
+
     LOGD("runSnapshotThread X");
 }
 
+void QualcommCameraHardware::restartPreviewAfterSnapshot(int generation)
+{
+    Mutex::Autolock l(&mLock);
+
+    if (generation != mSnapshotGeneration) {
+        LOGD("restartPreviewAfterSnapshot: snapshot %d superseded by %d",
+             generation, mSnapshotGeneration);
+        return;
+    }
+    if (!mPreviewRestartPending)
+        return;
+    mPreviewRestartPending = false;
+
+    // Frames are held back until the application calls startPreview():
+    // until then its surface is still set up for the picture.
+    mPreviewPaused = true;
+    if (startPreviewInternal() != NO_ERROR) {
+        mPreviewPaused = false;
+        LOGE("restartPreviewAfterSnapshot: could not restart preview");
+        return;
+    }
+
+    nsecs_t latency = systemTime() - mShutterRequestTime;
+    mShotToPreview.add(latency);
+    LOGD("restartPreviewAfterSnapshot: preview back %lld us after takePicture",
+         latency / 1000);
+}
+
 void *snapshot_thread(void *user)
 {
     LOGV("snapshot_thread E");
@@ -1287,6 +2845,8 @@ status_t QualcommCameraHardware::takePicture()
     LOGD("takePicture: E");
     Mutex::Autolock l(&mLock);
 
+    mShutterRequestTime = systemTime();
+
     // Wait for old snapshot thread to complete.
     mSnapshotThreadWaitLock.lock();
     while (mSnapshotThreadRunning) {
@@ -1297,23 +2857,37 @@ status_t QualcommCameraHardware::takePicture()
 
     if (mCameraRunning)
         stopPreviewInternal();
+    mPreviewPaused = false;
 
+    // The encode thread works from its own copies of earlier shots, so
+    // it can keep running while this one is captured.
+    mSnapshotParameters = mParameters;
+
+    nsecs_t setupStart = systemTime();
     if (!initRaw(mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE)) {
         LOGE("initRaw failed. Not taking picture.");
+        mSnapshotThreadWaitLock.unlock();
         return UNKNOWN_ERROR;
     }
+    nsecs_t setupTime = systemTime() - setupStart;
+    mSnapshotPoolSetup.add(setupTime);
+    LOGD("takePicture: snapshot pools ready in %lld us", setupTime / 1000);
 
     mShutterLock.lock();
     mShutterPending = true;
     mShutterLock.unlock();
 
+    mPreviewRestartPending = true;
+    mSnapshotGeneration++;
+
     pthread_attr_t attr;
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
     mSnapshotThreadRunning = !pthread_create(&mSnapshotThread,
                                              &attr,
                                              snapshot_thread,
-                                             NULL);
+                                             (void *)(intptr_t)
+                                                 mSnapshotGeneration);
     mSnapshotThreadWaitLock.unlock();
 
     LOGD("takePicture: X");
@@ -1326,13 +2900,13 @@ status_t QualcommCameraHardware::cancelPicture()
     return NO_ERROR;
 }
 
-static int ZOOM_STEP;
 status_t QualcommCameraHardware::setParameters(
         const CameraParameters& params)
 {
     LOGD("setParameters: E params = %p", &params);
 
     Mutex::Autolock l(&mLock);
+    nsecs_t start = systemTime();
 
     // Set preview size.
     preview_size_type *ps = preview_sizes;
@@ -1358,8 +2932,16 @@ status_t QualcommCameraHardware::setParameters(
 
     mPreviewWidth = mDimension.display_width = ps->width;
     mPreviewHeight = mDimension.display_height = ps->height;
+    mPreviewSizeIndex = ps - preview_sizes;
 
-    params.getPictureSize(&mRawWidth, &mRawHeight);
+    {
+        int width, height;
+        params.getPictureSize(&width, &height);
+        if (mRawInitialized && (width != mRawWidth || height != mRawHeight))
+            releaseSnapshotPools("picture size changed");
+        mRawWidth = width;
+        mRawHeight = height;
+    }
     mDimension.picture_width = mRawWidth;
     mDimension.picture_height = mRawHeight;
 
@@ -1384,15 +2966,82 @@ status_t QualcommCameraHardware::setParameters(
         else mDimension.ui_thumbnail_height = val;
     }
 
+    // Converted preview stream; preview frames themselves stay yuv420sp.
+    {
+        const char *format = params.get(KEY_CONVERTED_FORMAT);
+        int previewFormat = PREVIEW_FORMAT_YUV420SP;
+        if (format && !strcmp(format, CameraParameters::PIXEL_FORMAT_RGB565))
+            previewFormat = PREVIEW_FORMAT_RGB565;
+        else if (format && !strcmp(format, PIXEL_FORMAT_LUMA_HALF))
+            previewFormat = PREVIEW_FORMAT_LUMA_HALF;
+        else if (format && strcmp(format, "off"))
+            LOGW("preview-converted-format %s not supported, turning it off",
+                 format);
+        setPreviewConversion(previewFormat);
+    }
+
+    // Secondary preview stream; a decimation of 0 turns it off.
+    {
+        int decimation = params.getInt(KEY_SECONDARY_DECIMATION);
+        int downscale = params.getInt(KEY_SECONDARY_DOWNSCALE);
+        int shift = 0;
+        while (shift < kSecondaryShiftMax && (1 << shift) < downscale)
+            shift++;
+        if (decimation > 0 && ((1 << shift) != downscale ||
+                               mPreviewWidth % (1 << shift) ||
+                               mPreviewHeight % (1 << shift))) {
+            LOGE("preview-secondary-downscale %d not supported for %dx%d",
+                 downscale, mPreviewWidth, mPreviewHeight);
+            return BAD_VALUE;
+        }
+        setSecondaryPreview(decimation > 0 ? decimation : 0, shift);
+    }
+
+    // Burst capture: shot count, minimum spacing and raw frames in flight.
+    {
+        int val;
+
+        val = params.getInt(KEY_BURST_COUNT);
+        if (val < 1 || val > kBurstCountMax) {
+            LOGW("burst-count %d out of range, using 1", val);
+            val = 1;
+        }
+        mBurstCount = val;
+
+        val = params.getInt(KEY_BURST_INTERVAL);
+        mBurstInterval = val > 0 ? milliseconds(val) : 0;
+
+        val = params.getInt(KEY_BURST_BUFFERS);
+        if (val < 1 || val > kEncodeSlotsMax) {
+            LOGW("burst-buffers %d out of range, using %d", val,
+                 kEncodeSlotsMax / 2);
+            val = kEncodeSlotsMax / 2;
+        }
+        mEncodeSlots = val;
+
+        // Takes precedence over burst-count; the running average holds
+        // one slot while the next frame needs another.
+        val = params.getInt(KEY_NR_FRAMES);
+        if (val < 1 || val > kNrFramesMax) {
+            if (val != -1)
+                LOGW("noise-reduction-frames %d out of range, using 1", val);
+            val = 1;
+        }
+        mNrFrames = val;
+        if (mNrFrames > 1 && mEncodeSlots < 2)
+            mEncodeSlots = 2;
+    }
+
     // setParameters
     mParameters = params;
+    parseDriverSettings(params, &mWantedSettings);
 
     if (mCameraRunning) {
-        setEffect();
-        setWhiteBalance();
-        setZoom();
+        applyDriverSettings();
+        wakeFrameThread();
     }
 
+    mSetParametersCost.add(systemTime() - start);
     LOGV("setParameters: X");
     return NO_ERROR;
 }
@@ -1400,7 +3049,18 @@ status_t QualcommCameraHardware::setParameters(
 CameraParameters QualcommCameraHardware::getParameters() const
 {
     LOGV("getParameters: EX");
-    return mParameters;
+    CameraParameters params = mParameters;
+
+    // A smooth zoom moves the level without going through setParameters.
+    Mutex::Autolock lock(&mZoomLock);
+    if (mZoomStep > 0 && mZoomTarget >= 0)
+        params.set(CameraParameters::KEY_ZOOM, mZoomTarget / mZoomStep);
+    else if (mZoomStep == 0) {
+        for (size_t i = 0; i < ZOOM_RATIO_COUNT; i++)
+            if (zoom_ratios[i] == mSoftZoomRatio)
+                params.set(CameraParameters::KEY_ZOOM, (int)i);
+    }
+    return params;
 }
 
 extern "C" sp<CameraHardwareInterface> openCameraHardware()
@@ -1436,7 +3096,10 @@ sp<CameraHardwareInterface> QualcommCameraHardware::createInstance()
         }
     }
 
-    {
+    load_device_paths();
+
+    // A redirected control device does not need the modem's RPC router.
+    if (!strcmp(camera_control_path, MSM_CAMERA_CONTROL)) {
         struct stat st;
         int rc = stat("/dev/oncrpc", &st);
         if (rc < 0) {
@@ -1449,7 +3112,12 @@ sp<CameraHardwareInterface> QualcommCameraHardware::createInstance()
     sp<QualcommCameraHardware> hardware(cam);
     singleton = hardware;
 
+    // The library loads and device opens run in the background while the
+    // default parameters are built here.
+    cam->beginStartup();
+    nsecs_t start = systemTime();
     cam->initDefaultParameters();
+    cam->mStartupPhase[STARTUP_DEFAULT_PARAMETERS] = systemTime() - start;
     cam->startCamera();
 
     LOGD("createInstance: X created hardware=%p", &(*hardware));
@@ -1469,7 +3137,8 @@ sp<QualcommCameraHardware> QualcommCameraHardware::getInstance()
 }
 
 // passes the Addresses to CameraService to getPreviewHeap
-void QualcommCameraHardware::receivePreviewFrame(struct msm_frame_t *frame)
+void QualcommCameraHardware::receivePreviewFrame(struct msm_frame_t *frame,
+                                                 nsecs_t captureTime)
 {
     LOGV("receivePreviewFrame E");
 
@@ -1478,30 +3147,92 @@ void QualcommCameraHardware::receivePreviewFrame(struct msm_frame_t *frame)
         return;
     }
 
+    if (mPreviewPaused)
+        return;
+
     // Find the offset within the heap of the current buffer.
-    ssize_t offset = 0;
+    int offset = previewSlotFor(frame);
+    if (offset < 0) {
+        LOGE("receivePreviewFrame: frame not in the preview ring");
+        return;
+    }
+
+    if (queueSoftZoomFrame(offset, captureTime))
+        return;
+
+    deliverPreviewFrame(offset, captureTime);
+
+    LOGV("receivePreviewFrame X");
+}
+
+// Hands a preview slot to the display, the callbacks and the recorder.
+// Runs on the frame thread, or on the soft zoom thread while it has
+// frames queued, never on both at once.
+void QualcommCameraHardware::deliverPreviewFrame(int offset,
+                                                 nsecs_t captureTime)
+{
+    // The display keeps showing the newest frame until the next one is
+    // posted, so hold it until then.
+    acquirePreviewSlot(offset);
+    if (mDisplayedPreviewSlot >= 0)
+        releasePreviewSlot(mDisplayedPreviewSlot);
+    mDisplayedPreviewSlot = offset;
 
     mInPreviewCallback = true;
-    if (mMsgEnabled & CAMERA_MSG_PREVIEW_FRAME)
-        mDataCb(CAMERA_MSG_PREVIEW_FRAME, mPreviewHeap->mBuffers[offset], mCallbackCookie);
+    if (mMsgEnabled & CAMERA_MSG_PREVIEW_FRAME) {
+        nsecs_t entry = systemTime();
+        mPreviewToCallback.add(entry - captureTime);
+        mDataCb(CAMERA_MSG_PREVIEW_FRAME, mPreviewHeap->mBuffers[offset],
+                mCallbackCookie);
+        mPreviewCallbackTime.add(systemTime() - entry);
+    }
+
+    // CameraService only lets clients enable the standard messages, so
+    // these two streams are switched on by their parameters instead.
+    {
+        sp<MemoryBase> buffer = convertPreviewFrame(offset);
+        if (buffer != NULL)
+            mDataCb(CAMERA_MSG_PREVIEW_CONVERTED, buffer, mCallbackCookie);
+    }
+
+    {
+        sp<MemoryBase> buffer = secondaryPreviewFrame(offset);
+        if (buffer != NULL)
+            mDataCb(CAMERA_MSG_PREVIEW_SECONDARY, buffer, mCallbackCookie);
+    }
+
+    if (mVideoSnapshotPending)
+        captureVideoSnapshot(offset);
 
     if (mMsgEnabled & CAMERA_MSG_VIDEO_FRAME) {
-        Mutex::Autolock rLock(&mRecordFrameLock);
-        mDataCbTimestamp(systemTime(), CAMERA_MSG_VIDEO_FRAME,
-            mPreviewHeap->mBuffers[offset], mCallbackCookie);
-
-        if (mReleasedRecordingFrame != true) {
-            LOGD("block for release frame request/command");
-            if (!LINK_cam_release_frame())
-                LOGE("cam_release_frame failed");
-            mRecordWait.wait(mRecordFrameLock);
+        mRecordFrameLock.lock();
+        // Never let the encoder starve the VFE: if handing out this buffer
+        // would leave too few for capture and display, skip the frame.
+        bool drop = mRecordFrameHeld[offset] ||
+            mRecordFramesHeld >= mPreviewBufferCount - kMinFreePreviewBuffers;
+        if (drop) {
+            mRecordFramesDropped++;
+            LOGV("dropping video frame: encoder holds %d buffers",
+                 mRecordFramesHeld);
+        } else {
+            // Stays in flight until releaseRecordingFrame() hands it back.
+            mRecordFrameHeld[offset] = true;
+            mRecordFramesHeld++;
+            if (mRecordFramesHeld > mRecordFramesHeldMax)
+                mRecordFramesHeldMax = mRecordFramesHeld;
+            mRecordFramesDelivered++;
+            acquirePreviewSlot(offset);
+        }
+        mRecordFrameLock.unlock();
+
+        if (!drop) {
+            mCaptureToCallback.add(systemTime() - captureTime);
+            mDataCbTimestamp(captureTime, CAMERA_MSG_VIDEO_FRAME,
+                mPreviewHeap->mBuffers[offset], mCallbackCookie);
         }
-        mReleasedRecordingFrame = false;
     }
 
     mInPreviewCallback = false;
-
-    LOGV("receivePreviewFrame X");
 }
 
 status_t QualcommCameraHardware::startRecording()
@@ -1509,9 +3240,21 @@ status_t QualcommCameraHardware::startRecording()
     LOGD("startRecording E");
     Mutex::Autolock l(&mLock);
 
-    mReleasedRecordingFrame = false;
+    mCaptureToCallback.reset();
+    {
+        Mutex::Autolock rLock(&mRecordFrameLock);
+        mRecordFramesHeldMax = 0;
+        mRecordFramesDelivered = 0;
+        mRecordFramesDropped = 0;
+    }
     mCameraRecording = true;
 
+    // The video encoder allocates from the same pmem regions.
+    releaseSnapshotPools("recording started");
+
+    mPreviewRestartPending = false;
+    mPreviewPaused = false;
+
     return startPreviewInternal();
 }
 
@@ -1521,13 +3264,15 @@ void QualcommCameraHardware::stopRecording()
     Mutex::Autolock l(&mLock);
 
     {
-        mRecordFrameLock.lock();
-        mReleasedRecordingFrame = true;
-        mRecordWait.signal();
-        mRecordFrameLock.unlock();
-
         mCameraRecording = false;
 
+        LOGD("stopRecording: %u frames delivered, %u dropped, "
+             "encoder held at most %d buffers",
+             mRecordFramesDelivered, mRecordFramesDropped,
+             mRecordFramesHeldMax);
+
+        releaseVideoSnapshotHeaps();
+
         if(mMsgEnabled & CAMERA_MSG_PREVIEW_FRAME) {
             LOGD("stopRecording: X, preview still in progress");
             return;
@@ -1540,16 +3285,39 @@ void QualcommCameraHardware::stopRecording()
 }
 
 void QualcommCameraHardware::releaseRecordingFrame(
-       const sp<IMemory>& mem __attribute__((unused)))
+       const sp<IMemory>& mem)
 {
-    LOGD("releaseRecordingFrame E");
-    Mutex::Autolock l(&mLock);
+    LOGV("releaseRecordingFrame E");
     Mutex::Autolock rLock(&mRecordFrameLock);
+
     if (!LINK_cam_release_frame())
         LOGE("cam_release_frame failed");
-    mReleasedRecordingFrame = true;
-    mRecordWait.signal();
-    LOGD("releaseRecordingFrame X");
+
+    ssize_t offset;
+    size_t size;
+    sp<IMemoryHeap> heap = mem->getMemory(&offset, &size);
+
+    // Frames of a preview session that has since been torn down are
+    // simply forgotten.  mPreviewHeap only changes under mRecordFrameLock.
+    sp<PreviewPmemPool> previewHeap = mPreviewHeap;
+    if (previewHeap == NULL ||
+        heap->getHeapID() != previewHeap->mHeap->getHeapID()) {
+        LOGV("releaseRecordingFrame X: stale frame");
+        return;
+    }
+
+    int slot = offset / previewHeap->mBufferSize;
+    if (slot < 0 || slot >= mPreviewBufferCount || !mRecordFrameHeld[slot]) {
+        LOGE("releaseRecordingFrame: buffer at offset %ld is not in flight",
+             offset);
+        return;
+    }
+
+    mRecordFrameHeld[slot] = false;
+    mRecordFramesHeld--;
+    releasePreviewSlot(slot);
+
+    LOGV("releaseRecordingFrame X");
 }
 
 bool QualcommCameraHardware::recordingEnabled()
@@ -1562,43 +3330,84 @@ void QualcommCameraHardware::notifyShutter()
 {
     mShutterLock.lock();
     if (mShutterPending && (mMsgEnabled & CAMERA_MSG_SHUTTER)) {
+        mShutterLag.add(systemTime() - mShutterRequestTime);
         mNotifyCb(CAMERA_MSG_SHUTTER, 0, 0, mCallbackCookie);
         mShutterPending = false;
     }
     mShutterLock.unlock();
 }
 
-void QualcommCameraHardware::receiveRawPicture()
+void QualcommCameraHardware::receiveRawPicture(int slot, int shot, int count,
+                                               bool merge, nsecs_t requestTime)
 {
-    LOGD("receiveRawPicture: E");
+    LOGD("receiveRawPicture: E shot %d/%d", shot + 1, count);
 
     notifyShutter();
+    nsecs_t shutterTime = systemTime();
+    mCaptureStages[CAPTURE_SHUTTER].add(shutterTime - requestTime);
+
+    // GET_PICTURE returns once the VFE has written the frame out, which
+    // the encode copy below depends on as much as the raw callback.
+    if(native_get_picture(mCameraControlFd, &mCrop) == false) {
+        LOGE("getPicture failed!");
+        if (slot >= 0)
+            releaseEncodeSlot(slot);
+        return;
+    }
+    nsecs_t rawReadyTime = systemTime();
+    mCaptureStages[CAPTURE_RAW_READY].add(rawReadyTime - shutterTime);
 
-    if (mMsgEnabled & CAMERA_MSG_RAW_IMAGE) {
-        if(native_get_picture(mCameraControlFd, &mCrop) == false) {
-            LOGE("getPicture failed!");
-            return;
-        }
+    if (mMsgEnabled & CAMERA_MSG_RAW_IMAGE)
         mDataCb(CAMERA_MSG_RAW_IMAGE, mRawHeap->mBuffers[0], mCallbackCookie);
-    }
     else LOGD("Raw-picture callback was canceled--skipping.");
 
-    if (mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE) {
-        mJpegSize = mRawWidth * mRawHeight * 3/2;
-        if (LINK_jpeg_encoder_init()) {
-            if(native_jpeg_encode()) {
-                LOGD("receiveRawPicture: X (success)");
-                return;
+    if (slot >= 0) {
+        // Kept from the old hardware encoder setup; every dimension update
+        // after the first picture has gone out with these set.
+        mDimension.filler7 = 2560;
+        mDimension.filler8 = 1920;
+
+        // Free mRawHeap for the next shot as soon as possible, zooming on
+        // the way if the driver could not.  A single slot is encoded from
+        // mRawHeap itself, zoomed in place through a temporary copy.
+        uint8_t *raw = (uint8_t *)mRawHeap->mHeap->base();
+        int ratio = mSoftZoomRatio;
+        if (mEncodeHeap != NULL) {
+            uint8_t *encodeBuffer = (uint8_t *)mEncodeHeap->mHeap->base() +
+                                    slot * mEncodeHeap->mBufferSize;
+            if (ratio > 100) {
+                nsecs_t zoomStart = systemTime();
+                yuv420sp_zoom(raw, encodeBuffer, mRawWidth, mRawHeight,
+                              ratio);
+                mSoftZoomSnapshotCost.add(systemTime() - zoomStart);
+            }
+            else memcpy(encodeBuffer, raw, mRawSize);
+        } else if (ratio > 100) {
+            nsecs_t zoomStart = systemTime();
+            uint8_t *copy = (uint8_t *)malloc(mRawSize);
+            if (copy != NULL) {
+                memcpy(copy, raw, mRawSize);
+                yuv420sp_zoom(copy, raw, mRawWidth, mRawHeight, ratio);
+                free(copy);
+                mSoftZoomSnapshotCost.add(systemTime() - zoomStart);
             }
-            LOGE("jpeg encoding failed");
+            else LOGE("receiveRawPicture: out of memory, not zooming");
         }
-        else LOGE("receiveRawPicture X: jpeg_encoder_init failed.");
+
+        EncodeJob job;
+        job.mShot = shot;
+        job.mBurstCount = count;
+        job.mWidth = mRawWidth;
+        job.mHeight = mRawHeight;
+        job.mRequestTime = requestTime;
+        job.mRawReadyTime = rawReadyTime;
+        job.mBurstStart = mShutterRequestTime;
+        job.mMergeFrames = merge ? count : 1;
+        job.mParameters = mSnapshotParameters;
+        queueEncodeJob(slot, job);
     }
     else LOGD("JPEG callback is NULL, not encoding image.");
 
-    if (mRawInitialized)
-        deinitRaw();
-
     LOGD("receiveRawPicture: X");
 }
 
@@ -1621,110 +3430,302 @@ void QualcommCameraHardware::receiveJpegPictureFragment(
     mJpegSize += buff_size;
 }
 
-void QualcommCameraHardware::receiveJpegPicture(void)
+// From libmmcamera's encoder, which fills mJpegHeap fragment by fragment.
+void QualcommCameraHardware::receiveJpegPicture(int index)
 {
-    LOGD("receiveJpegPicture: E image (%d uint8_ts out of %d)",
-         mJpegSize, mJpegHeap->mBufferSize);
-
-        LOGD("mJpegHeap->mFrameOffset %d", mJpegHeap->mFrameOffset ) ;
+    receiveJpegPicture(mJpegHeap->mHeap,
+                       index * mJpegHeap->mBufferSize +
+                       mJpegHeap->mFrameOffset);
+}
 
-    int index = 0, rc;
+sp<MemoryBase> QualcommCameraHardware::receiveJpegPicture(
+    const sp<MemoryHeapBase> &heap, int offset)
+{
+    LOGD("receiveJpegPicture: E image (%d uint8_ts at offset %d)",
+         mJpegSize, offset);
 
     if (mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE) {
         // The reason we do not allocate into mJpegHeap->mBuffers[offset] is
         // that the JPEG image's size will probably change from one snapshot
         // to the next, so we cannot reuse the MemoryBase object.
         sp<MemoryBase> buffer = new
-            MemoryBase(mJpegHeap->mHeap,
-                       index * mJpegHeap->mBufferSize +
-                       mJpegHeap->mFrameOffset,
+            MemoryBase(heap,
+                       offset,
                        mJpegSize);
 
         mDataCb(CAMERA_MSG_COMPRESSED_IMAGE, buffer, mCallbackCookie);
-        buffer = NULL;
+        LOGD("receiveJpegPicture: X callback done.");
+        return buffer;
     }
     else LOGD("JPEG callback was cancelled--not delivering image.");
 
-    if (mRawInitialized)
-        deinitRaw();
-
     LOGD("receiveJpegPicture: X callback done.");
+    return NULL;
 }
 
 bool QualcommCameraHardware::previewEnabled()
 {
     Mutex::Autolock l(&mLock);
-    return (mCameraRunning && (mMsgEnabled & CAMERA_MSG_PREVIEW_FRAME));
+    return (mCameraRunning && !mPreviewPaused &&
+            (mMsgEnabled & CAMERA_MSG_PREVIEW_FRAME));
 }
 
-int QualcommCameraHardware::getParm(
-    const char *parm_str, const struct str_map *const parm_map)
+// Everything the driver needs from CameraParameters, looked up once per
+// setParameters() instead of once per control command.
+void QualcommCameraHardware::parseDriverSettings(
+    const CameraParameters& params, DriverSettings *settings)
 {
-    // Check if the parameter exists.
-    const char *str = mParameters.get(parm_str);
-    if (str == NULL) return NOT_FOUND;
+    settings->effect = attr_lookup(effect, params.get("effect"));
+    settings->whiteBalance =
+        attr_lookup(whitebalance, params.get("whitebalance"));
+    settings->zoom = params.getInt("zoom");
 
-    // Look up the parameter value.
-    return attr_lookup(parm_map, str);
+    // a dirty hack to prevent blank screen
+    switch (attr_lookup(picturesize, params.get("picture-size"))) {
+        case NOT_FOUND:
+            settings->zoomStep = NOT_FOUND;
+            break;
+        case SHOT_1M_SIZE:
+            settings->zoomStep = 4;
+            break;
+        case SHOT_2M_SIZE:
+            settings->zoomStep = 2;
+            break;
+        case SHOT_3M_SIZE:
+        default:
+            settings->zoomStep = 0;
+    }
 }
 
-void QualcommCameraHardware::setEffect()
+// Sends the driver only the settings that differ from what it last
+// accepted, one control command each.  A failed command leaves the
+// applied value alone so it is retried on the next call.  Antibanding is
+// left out: this HAL has never sent it, and the driver's handling of it
+// has not been checked.
+void QualcommCameraHardware::applyDriverSettings()
 {
-    int32_t value = getParm("effect", effect);
-    if (value != NOT_FOUND && value != mEffect) {
-        native_set_parm(CAMERA_SET_PARM_EFFECT, sizeof(value), (void *)&value);
-        mEffect = value;
+    const DriverSettings &want = mWantedSettings;
+    struct {
+        cam_ctrl_type type;
+        int32_t value;
+        int32_t *applied;
+    } pending[2];
+    int count = 0;
+
+#define QUEUE_SETTING(field, ctrl) do {                                        \
+        if (want.field != NOT_FOUND && want.field != mAppliedSettings.field) { \
+            pending[count].type = ctrl;                                          \
+            pending[count].value = want.field;                                   \
+            pending[count].applied = &mAppliedSettings.field;                    \
+            count++;                                                           \
+        }                                                                      \
+        else mParmCommandsSkipped++;                                           \
+    } while(0)
+
+    QUEUE_SETTING(effect, CAMERA_SET_PARM_EFFECT);
+    QUEUE_SETTING(whiteBalance, CAMERA_SET_PARM_WB);
+#undef QUEUE_SETTING
+
+    for (int i = 0; i < count; i++) {
+        if (native_set_parm(pending[i].type, sizeof(pending[i].value),
+                            (void *)&pending[i].value))
+            *pending[i].applied = pending[i].value;
     }
+    mParmCommandsSent += count;
+
+    int32_t zoomStep = want.zoomStep != NOT_FOUND ?
+                       want.zoomStep : mAppliedSettings.zoomStep;
+    if (want.zoom >= 0 && (zoomStep != mAppliedSettings.zoomStep ||
+                           want.zoom != mAppliedSettings.zoom)) {
+        if (setZoom(zoomStep, want.zoom)) {
+            mAppliedSettings.zoomStep = zoomStep;
+            mAppliedSettings.zoom = want.zoom;
+        }
+    }
+    else mParmCommandsSkipped++;
 }
 
-void QualcommCameraHardware::setWhiteBalance()
+static int32_t maxZoom = -1;
+bool QualcommCameraHardware::setZoom(int32_t step, int32_t index)
 {
-    int32_t value = getParm("whitebalance", whitebalance);
-    if (value != NOT_FOUND && value != mWhiteBalance) {
-        native_set_parm(CAMERA_SET_PARM_WB, sizeof(value), (void *)&value);
-        mWhiteBalance = value;
+    if (step != NOT_FOUND) {
+        Mutex::Autolock lock(&mZoomLock);
+        mZoomStep = step;
     }
+
+    return requestZoom(index, false);
 }
 
-void QualcommCameraHardware::setAntibanding()
+// Only moves the zoom target; the zoom thread does the driver work, and
+// animates only smooth zooms.  A newer request simply replaces an older
+// one that has not been reached.
+bool QualcommCameraHardware::requestZoom(int index, bool smooth)
 {
-    int32_t value = getParm("antibanding", antibanding);
-    if (value != NOT_FOUND) {
-        native_set_parm(CAMERA_SET_PARM_ANTIBANDING, sizeof(value), (void *)&value);
+    mZoomLock.lock();
+    if (mZoomStep == 0) {
+        // The driver cannot zoom at this picture size: zoom in software,
+        // in one go, and walk any hardware zoom back out.
+        if (index < 0 || index >= (int)ZOOM_RATIO_COUNT) {
+            mZoomLock.unlock();
+            LOGE("requestZoom: zoom %d out of range", index);
+            return false;
+        }
+        mSoftZoomRatio = zoom_ratios[index];
+        mSmoothZooming = false;
+        if (mZoomThreadRunning && mZoomTarget > 0) {
+            mZoomTarget = 0;
+            mZoomCondition.signal();
+        }
+        mZoomLock.unlock();
+
+        if (smooth && (mMsgEnabled & CAMERA_MSG_ZOOM))
+            mNotifyCb(CAMERA_MSG_ZOOM, index, true, mCallbackCookie);
+        return true;
     }
-}
+    mSoftZoomRatio = 100;
+    mZoomLock.unlock();
 
-static int32_t maxZoom = -1;
-void QualcommCameraHardware::setZoom()
-{
     if (maxZoom == -1) { // init
         if (!native_get_maxzoom(mCameraControlFd, (void *)&maxZoom)) {
             LOGE("native_get_maxzoom failed %s", strerror(errno));
-            return;
+            return false;
         }
     }
 
-    // a dirty hack to prevent blank screen
-    int32_t size = getParm("picture-size", picturesize);
-    if (size != NOT_FOUND) {
-        switch (size) {
-            case SHOT_1M_SIZE:
-                ZOOM_STEP = 4;
-                break;
-            case SHOT_2M_SIZE:
-                ZOOM_STEP = 2;
-                break;
-            case SHOT_3M_SIZE:
-            default:
-                ZOOM_STEP = 0;
-        }
+    if (!startZoomThread())
+        return false;
+
+    mZoomLock.lock();
+
+    int32_t value = mZoomStep * index;
+    if (value < 0 || value > maxZoom) {
+        mZoomLock.unlock();
+        LOGE("requestZoom: zoom %d (%d) out of range", index, value);
+        return false;
+    }
+
+    // A smooth zoom owns the zoom level until it stops.
+    if (!smooth && mSmoothZooming) {
+        mZoomLock.unlock();
+        return true;
+    }
+
+    mZoomTarget = value;
+    mSmoothZooming = smooth && value != mZoomCurrent;
+    bool arrived = smooth && !mSmoothZooming;
+    mZoomCondition.signal();
+    mZoomLock.unlock();
+
+    if (arrived && (mMsgEnabled & CAMERA_MSG_ZOOM))
+        mNotifyCb(CAMERA_MSG_ZOOM, index, true, mCallbackCookie);
+    return true;
+}
+
+void QualcommCameraHardware::stopSmoothZoom()
+{
+    mZoomLock.lock();
+    if (!mSmoothZooming) {
+        mZoomLock.unlock();
+        return;
     }
+    mSmoothZooming = false;
+    if (mZoomCurrent >= 0)
+        mZoomTarget = mZoomCurrent;
+    int index = mZoomStep > 0 ? mZoomTarget / mZoomStep : -1;
+    mZoomLock.unlock();
+
+    if (index >= 0 && (mMsgEnabled & CAMERA_MSG_ZOOM))
+        mNotifyCb(CAMERA_MSG_ZOOM, index, true, mCallbackCookie);
+}
+
+void QualcommCameraHardware::runZoomThread(void *data)
+{
+    LOGD("runZoomThread E");
+
+    mZoomLock.lock();
+    for (;;) {
+        while (!mZoomThreadExit && mZoomCurrent == mZoomTarget)
+            mZoomCondition.wait(mZoomLock);
+        if (mZoomThreadExit)
+            break;
+
+        // A smooth zoom walks one driver step at a time so the change is
+        // spread over several frames; any other target, and the very first
+        // level, is applied in one go.
+        int32_t value = mZoomTarget;
+        bool smooth = mSmoothZooming;
+        if (smooth && mZoomCurrent >= 0)
+            value = mZoomCurrent + (mZoomTarget > mZoomCurrent ? 1 : -1);
+        int step = mZoomStep;
+        mZoomLock.unlock();
 
-    int32_t value = ZOOM_STEP * mParameters.getInt("zoom");
-    if (value >= 0 && value <= maxZoom) {
         native_set_parm(CAMERA_SET_PARM_ZOOM, sizeof(value), (void *)&value);
-        usleep(30000);
+
+        mZoomLock.lock();
+        mZoomCurrent = value;
+        bool done = value == mZoomTarget;
+        bool notify = false;
+        if (smooth && mSmoothZooming) {
+            if (done)
+                mSmoothZooming = false;
+            notify = step > 0 && (done || value % step == 0);
+        }
+        mZoomLock.unlock();
+
+        if (notify && (mMsgEnabled & CAMERA_MSG_ZOOM))
+            mNotifyCb(CAMERA_MSG_ZOOM, value / step, done, mCallbackCookie);
+
+        // The VFE needs about this long to settle on a new zoom level
+        // before it takes the next one without blanking the preview.
+        nsecs_t settle = mFramePeriod > milliseconds(30) ?
+                         mFramePeriod : milliseconds(30);
+        usleep(settle / 1000);
+
+        mZoomLock.lock();
+    }
+    mZoomLock.unlock();
+
+    LOGD("runZoomThread X");
+}
+
+void *zoom_thread(void *user)
+{
+    LOGV("zoom_thread E");
+    sp<QualcommCameraHardware> obj = QualcommCameraHardware::getInstance();
+    if (obj != 0) {
+        obj->runZoomThread(user);
     }
+    else LOGW("not starting zoom thread: the object went away!");
+    LOGV("zoom_thread X");
+    return NULL;
+}
+
+bool QualcommCameraHardware::startZoomThread()
+{
+    if (mZoomThreadRunning)
+        return true;
+
+    mZoomThreadExit = false;
+    mZoomThreadRunning = !pthread_create(&mZoomThread, NULL, zoom_thread, NULL);
+    if (!mZoomThreadRunning)
+        LOGE("startZoomThread: could not create the zoom thread");
+    return mZoomThreadRunning;
+}
+
+void QualcommCameraHardware::stopZoomThread()
+{
+    if (!mZoomThreadRunning)
+        return;
+
+    mZoomLock.lock();
+    mZoomThreadExit = true;
+    mSmoothZooming = false;
+    mZoomCondition.signal();
+    mZoomLock.unlock();
+
+    if (pthread_join(mZoomThread, NULL))
+        LOGE("zoom_thread exit failure: %s", strerror(errno));
+    mZoomThreadRunning = false;
 }
 
 QualcommCameraHardware::MemPool::MemPool(int buffer_size, int num_buffers,
@@ -1805,6 +3806,7 @@ QualcommCameraHardware::PmemPool::PmemPool(const char *pmem_pool,
                                     frame_size,
                                     frame_offset,
                                     name),
+    mPmemPool(pmem_pool),
     mPmemType(pmem_type),
     mCameraControlFd(camera_control_fd)
 {
@@ -1894,7 +3896,7 @@ QualcommCameraHardware::PreviewPmemPool::PreviewPmemPool(
                         int frame_size,
                         int frame_offset,
                         const char *name) :
-    QualcommCameraHardware::PmemPool("/dev/pmem_adsp", control_fd, MSM_PMEM_OUTPUT2,
+    QualcommCameraHardware::PmemPool(pmem_adsp_path, control_fd, MSM_PMEM_OUTPUT2,
                                  buffer_size,
                                  num_buffers,
                                  frame_size,
@@ -1978,14 +3980,117 @@ status_t QualcommCameraHardware::MemPool::dump(int fd, const Vector<String16>& a
     return NO_ERROR;
 }
 
-static void receive_camframe_callback(struct msm_frame_t *frame)
+// One line per pool that is currently allocated, then the totals and
+// what the budget is working from.
+void QualcommCameraHardware::dumpMemoryUsage(int fd) const
 {
-    LOGV("receive_camframe_callback E");
-    sp<QualcommCameraHardware> obj = QualcommCameraHardware::getInstance();
-    if (obj != 0) {
-        obj->receivePreviewFrame(frame);
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    String8 result("camera memory:\n");
+
+    const MemPool *pools[] = {
+        mPreviewHeap.get(), mThumbnailHeap.get(), mRawHeap.get(),
+        mEncodeHeap.get(), mJpegHeap.get(), mConvertHeap.get(),
+        mSecondaryHeap.get(), mVideoSnapshotHeap.get(),
+        mVideoSnapshotJpegHeap.get(),
+    };
+    size_t pmemBytes = 0, ashmemBytes = 0;
+    for (size_t i = 0; i < sizeof(pools) / sizeof(pools[0]); i++) {
+        const MemPool *pool = pools[i];
+        if (pool == NULL || pool->mHeap == NULL)
+            continue;
+        const char *device = pool->device();
+        size_t bytes = pool->mHeap->getSize();
+        snprintf(buffer, 255, "  %-22s %-16s %d x %7d bytes, frame %7d, "
+                 "mapped %8u\n", pool->mName, device ? device : "ashmem",
+                 pool->mNumBuffers, pool->mBufferSize, pool->mFrameSize,
+                 bytes);
+        result.append(buffer);
+        if (device)
+            pmemBytes += bytes;
+        else
+            ashmemBytes += bytes;
+    }
+    snprintf(buffer, 255, "  total pmem %u kB, ashmem %u kB, "
+             "zoom scratch %d kB\n", pmemBytes / 1024, ashmemBytes / 1024,
+             mZoomScratchSize / 1024);
+    result.append(buffer);
+    snprintf(buffer, 255, "  system %d kB available, low at %d kB (%s), "
+             "pools trimmed (%u), jpeg overflows (%u)\n",
+             mMemoryAvailableKb, mMemoryLowKb, mMemoryLow ? "low" : "ok",
+             mMemoryTrims, mJpegOverflows);
+    result.append(buffer);
+    for (int band = 0; band < kJpegQualityBands; band++) {
+        if (!mJpegBytesPerPixel[band])
+            continue;
+        snprintf(buffer, 255, "  jpeg quality %d-%d: %u.%02u bytes/pixel\n",
+                 band * 10, band < 10 ? band * 10 + 9 : 100,
+                 mJpegBytesPerPixel[band] >> 8,
+                 (mJpegBytesPerPixel[band] & 0xff) * 100 / 256);
+        result.append(buffer);
     }
-    LOGV("receive_camframe_callback X");
+    write(fd, result.string(), result.size());
+}
+
+QualcommCameraHardware::LatencyHistogram::LatencyHistogram(const char *name) :
+    mName(name)
+{
+    reset();
+}
+
+void QualcommCameraHardware::LatencyHistogram::reset()
+{
+    Mutex::Autolock lock(mLock);
+    mCount = 0;
+    mSumUs = 0;
+    mMinUs = 0;
+    mMaxUs = 0;
+    memset(mBuckets, 0, sizeof(mBuckets));
+}
+
+void QualcommCameraHardware::LatencyHistogram::add(nsecs_t latency)
+{
+    int64_t us = latency / 1000;
+    if (us < 0)
+        us = 0;
+
+    int bucket = 0;
+    while (bucket < kBuckets - 1 && (us >> (bucket + 1)) > 0)
+        bucket++;
+
+    Mutex::Autolock lock(mLock);
+    if (mCount == 0 || us < mMinUs)
+        mMinUs = us;
+    if (us > mMaxUs)
+        mMaxUs = us;
+    mSumUs += us;
+    mCount++;
+    mBuckets[bucket]++;
+}
+
+void QualcommCameraHardware::LatencyHistogram::dump(int fd) const
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    String8 result;
+
+    Mutex::Autolock lock(mLock);
+    snprintf(buffer, 255, "%s: %u samples", mName, mCount);
+    result.append(buffer);
+    if (mCount) {
+        snprintf(buffer, 255, ", min %lld us, avg %lld us, max %lld us",
+                 mMinUs, mSumUs / mCount, mMaxUs);
+        result.append(buffer);
+    }
+    result.append("\n");
+    for (int i = 0; i < kBuckets; i++) {
+        if (!mBuckets[i])
+            continue;
+        snprintf(buffer, 255, "  < %8lld us: %u\n",
+                 (int64_t)2 << i, mBuckets[i]);
+        result.append(buffer);
+    }
+    write(fd, result.string(), result.size());
 }
 
 static void receive_jpeg_fragment_callback(uint8_t *buff_ptr, uint32_t buff_size)
@@ -2004,7 +4109,7 @@ static void receive_jpeg_callback(jpeg_event_t status)
     if (status == JPEG_EVENT_DONE) {
         sp<QualcommCameraHardware> obj = QualcommCameraHardware::getInstance();
         if (obj != 0) {
-            obj->receiveJpegPicture();
+            obj->receiveJpegPicture(0);
         }
     }
     LOGV("receive_jpeg_callback X");
@@ -2013,7 +4118,22 @@ static void receive_jpeg_callback(jpeg_event_t status)
 status_t QualcommCameraHardware::sendCommand(int32_t command, int32_t arg1,
                                              int32_t arg2)
 {
-    LOGD("sendCommand: EX");
+    LOGD("sendCommand: EX command %d", command);
+    Mutex::Autolock l(&mLock);
+
+    switch (command) {
+    case CAMERA_CMD_START_SMOOTH_ZOOM:
+        if (!mCameraRunning)
+            return INVALID_OPERATION;
+        // The level it ends on is not one setParameters() asked for.
+        mAppliedSettings.zoom = NOT_FOUND;
+        return requestZoom(arg1, true) ? NO_ERROR : BAD_VALUE;
+    case CAMERA_CMD_STOP_SMOOTH_ZOOM:
+        stopSmoothZoom();
+        return NO_ERROR;
+    case CAMERA_CMD_VIDEO_SNAPSHOT:
+        return takeVideoSnapshot();
+    }
     return BAD_VALUE;
 }
 
@@ -43,6 +43,19 @@ extern "C" {
 #define CAMERA_START_PREVIEW 39
 #define CAMERA_EXIT 43
 
+// Data messages for the secondary and converted preview streams; outside
+// the framework's CAMERA_MSG_* range.  They are sent whenever their
+// stream is turned on by its parameter.  CameraService hands data
+// messages it does not know to ICameraClient::dataCallback unchanged, so
+// native clients get them through CameraListener::postData(); the Java
+// layer ignores them.
+#define CAMERA_MSG_PREVIEW_SECONDARY 0x8000
+#define CAMERA_MSG_PREVIEW_CONVERTED 0x10000
+
+// sendCommand() extension: JPEG of the next preview frame while
+// recording, delivered as CAMERA_MSG_COMPRESSED_IMAGE.
+#define CAMERA_CMD_VIDEO_SNAPSHOT 0x100
+
 #define CAMERA_START_SNAPSHOT 40
 #define CAMERA_STOP_SNAPSHOT 42 //41
 
@@ -178,6 +191,13 @@ public:
     static sp<CameraHardwareInterface> createInstance();
     static sp<QualcommCameraHardware> getInstance();
 
+    /* These constants reflect the number of buffers that libmmcamera requires
+       for preview and raw, and need to be updated when libmmcamera
+       changes.
+    */
+    static const int kPreviewBufferCountMin = 3;
+    static const int kPreviewBufferCountMax = 6;
+
     bool reg_unreg_buf(int camfd,
                        int width,
                        int height,
@@ -193,8 +213,11 @@ public:
                                         void *pDim,
                                         struct msm_frame_t *frame);
 
-    void receivePreviewFrame(struct msm_frame_t *frame);
-    void receiveJpegPicture(void);
+    void receivePreviewFrame(struct msm_frame_t *frame, nsecs_t captureTime);
+    void deliverPreviewFrame(int offset, nsecs_t captureTime);
+    void receiveJpegPicture(int index);
+    sp<MemoryBase> receiveJpegPicture(const sp<MemoryHeapBase> &heap,
+                                      int offset);
     void jpeg_set_location();
     void receiveJpegPictureFragment(uint8_t *buf, uint32_t size);
     void notifyShutter();
@@ -205,20 +228,14 @@ private:
     status_t startPreviewInternal();
     void stopPreviewInternal();
     bool native_set_dimension (int camfd);
-    bool native_jpeg_encode (void);
     bool native_set_parm(cam_ctrl_type type, uint16_t length, void *value);
     bool native_set_dimension(cam_ctrl_dimension_t *value);
-    int getParm(const char *parm_str, const str_map *parm_map);
 
     static wp<QualcommCameraHardware> singleton;
 
-    /* These constants reflect the number of buffers that libmmcamera requires
-       for preview and raw, and need to be updated when libmmcamera
-       changes.
-    */
-    static const int kPreviewBufferCount = 2;
     static const int kRawBufferCount = 1;
-    static const int kJpegBufferCount = 1;
+    static const int kEncodeSlotsMax = 4;
+    static const int kBurstCountMax = 10;
     static const int kRawFrameHeaderSize = 0;
 
     //TODO: put the picture dimensions in the CameraParameters object;
@@ -232,6 +249,25 @@ private:
     bool mPreviewInitialized;
     bool mRawInitialized;
 
+    // Power-of-two bucketed latency distribution, reported through dump().
+    struct LatencyHistogram {
+        LatencyHistogram(const char *name = NULL);
+
+        void reset();
+        void add(nsecs_t latency);
+        void dump(int fd) const;
+
+        static const int kBuckets = 24;
+
+        const char *mName;
+        mutable Mutex mLock;
+        uint32_t mCount;
+        int64_t mSumUs;
+        int64_t mMinUs;
+        int64_t mMaxUs;
+        uint32_t mBuckets[kBuckets];
+    };
+
     // This class represents a heap which maintains several contiguous
     // buffers.  The heap may be backed by pmem (when pmem_pool contains
     // the name of a /dev/pmem* file), or by ashmem (when pmem_pool == NULL).
@@ -250,6 +286,8 @@ private:
         }
 
         virtual status_t dump(int fd, const Vector<String16>& args) const;
+        // The pmem device behind the heap, NULL for ashmem.
+        virtual const char *device() const { return NULL; }
 
         int mBufferSize;
         int mNumBuffers;
@@ -276,6 +314,8 @@ private:
                  int frame_size, int frame_offset,
                  const char *name);
         virtual ~PmemPool();
+        virtual const char *device() const { return mPmemPool; }
+        const char *mPmemPool;
         int mFd;
         msm_pmem_t mPmemType;
         int mCameraControlFd;
@@ -296,25 +336,169 @@ private:
     sp<PreviewPmemPool> mPreviewHeap;
     sp<PmemPool> mThumbnailHeap;
     sp<PmemPool> mRawHeap;
+    sp<AshmemPool> mEncodeHeap;
     sp<AshmemPool> mJpegHeap;
 
+    // Camera open phases, timed for dump().  The first
+    // STARTUP_ASYNC_PHASE_COUNT run concurrently on their own threads.
+    enum {
+        STARTUP_LOAD_LIBRARIES,
+        STARTUP_OPEN_DEVICE,
+        STARTUP_PREVIEW_POOL,
+        STARTUP_ASYNC_PHASE_COUNT,
+        STARTUP_DEFAULT_PARAMETERS = STARTUP_ASYNC_PHASE_COUNT,
+        STARTUP_JPEG_INIT,
+        STARTUP_CONFIG_THREAD,
+        STARTUP_TOTAL,
+        STARTUP_PHASE_COUNT
+    };
+    nsecs_t mStartupBegin;
+    nsecs_t mStartupPhase[STARTUP_PHASE_COUNT];
+    pthread_t mStartupThread[STARTUP_ASYNC_PHASE_COUNT];
+    bool mStartupThreadStarted[STARTUP_ASYNC_PHASE_COUNT];
+    friend void *startup_thread(void *phase);
+    void runStartupPhase(int phase);
+    void beginStartup();
     void startCamera();
     bool initPreview();
     void deinitPreview();
     bool initRaw(bool initJpegHeap);
     void deinitRaw();
+    void releaseSnapshotPools(const char *reason);
+
+    // Snapshot pools outlive a single takePicture(); these count how
+    // often a shot found them ready versus had to (re)allocate them.
+    unsigned mSnapshotPoolAllocs;
+    unsigned mSnapshotPoolReuses;
+    LatencyHistogram mSnapshotPoolSetup;
+
+    // Memory budget.  Pools are sized for what the current settings need
+    // rather than for the worst case: JPEG slots from the compressed sizes
+    // seen so far at each quality (8.8 fixed point bytes per pixel, 0 until
+    // the first picture), with a one-off heap for a picture that does not
+    // fit.  While the system is short of memory, checked when a pool is
+    // about to be allocated, the preview ring and encode slots shrink to
+    // their minimum.
+    static const int kJpegQualityBands = 11;
+    static const int kJpegExifRoom = 4096;
+    uint32_t mJpegBytesPerPixel[kJpegQualityBands];
+    bool mMemoryLow;
+    int mMemoryAvailableKb;
+    int mMemoryLowKb;
+    unsigned mMemoryTrims;
+    unsigned mJpegOverflows;
+    bool checkMemoryPressure();
+    int predictJpegSize(int width, int height, int quality);
+    void recordJpegSize(int width, int height, int quality, uint32_t size);
+    int encodeSlotBudget() const;
+    void dumpMemoryUsage(int fd) const;
+
+    // Burst capture.  The snapshot thread copies each raw frame out of
+    // mRawHeap into a free slot of mEncodeHeap and queues it; the encode
+    // thread turns queued slots into JPEGs in the matching slot of
+    // mJpegHeap, so capturing shot k+1 overlaps encoding shot k.
+    // mEncodeSlots bounds the number of raw frames in flight.
+    struct EncodeJob {
+        int mShot;
+        int mBurstCount;
+        int mWidth;
+        int mHeight;
+        nsecs_t mRequestTime;
+        nsecs_t mRawReadyTime;
+        nsecs_t mBurstStart;
+        int mMergeFrames;
+        CameraParameters mParameters;
+        // Video snapshots only: the heaps the job was armed with, which
+        // stay valid even if the camera lets go of its own references.
+        sp<AshmemPool> mSnapshotHeap;
+        sp<AshmemPool> mSnapshotJpegHeap;
+    };
+
+    int mBurstCount;
+    nsecs_t mBurstInterval;
+    int mEncodeSlots;
+    CameraParameters mSnapshotParameters;
+    EncodeJob mEncodeJobs[kEncodeSlotsMax + 1];
+    bool mEncodeSlotBusy[kEncodeSlotsMax + 1];
+    // The JPEG last delivered from each slot, which stays out of use until
+    // the client has let go of it.
+    sp<MemoryBase> mJpegDelivered[kEncodeSlotsMax];
+    Vector<int> mEncodeQueue;
+    Mutex mEncodeLock;
+    Condition mEncodeCondition;
+    bool mEncodeThreadRunning;
+    bool mEncodeThreadExit;
+    pthread_t mEncodeThread;
+    LatencyHistogram mShotLatency;
+    int mLastBurstShots;
+    nsecs_t mLastBurstDuration;
 
     friend void *jpeg_encoder_thread( void *user );
     void runJpegEncodeThread(void *data);
-
+    void encodeJpeg(int slot, const EncodeJob &job);
+    bool startEncodeThread();
+    void stopEncodeThread();
+    int acquireEncodeSlot();
+    void queueEncodeJob(int slot, const EncodeJob &job);
+    void releaseEncodeSlot(int slot);
+
+    // Multi-frame noise reduction: takePicture() captures mNrFrames shots
+    // back to back and the encode thread folds each into the first one's
+    // slot as it arrives, shifted by a global translation estimated from
+    // luma projections, then encodes the running average as one picture.
+    // The mNr* merge state belongs to the encode thread.
+    static const int kNrFramesMax = 4;
+    static const int kNrMaxShift = 32;
+    int mNrFrames;
+    int mNrSlot;
+    int mNrFramesMerged;
+    uint32_t *mNrReference;
+    LatencyHistogram mNrMergeCost;
+    int mergeNoiseReductionFrame(int slot, const EncodeJob &job);
+    void resetNoiseReduction();
+
+    // Video snapshot.  The encode slots have one extra, backed by its own
+    // preview-sized heaps, so the frame thread only copies a frame and at
+    // most one such snapshot is in flight.  It is encoded on a short-lived
+    // thread of its own at background priority, so the frame thread keeps
+    // feeding the video encoder; the media server could not raise a
+    // thread's priority back afterwards.  mVideoSnapshotPending, the heaps
+    // and the thread are guarded by mEncodeLock.
+    static const int kVideoSnapshotSlot = kEncodeSlotsMax;
+    bool mVideoSnapshotPending;
+    sp<AshmemPool> mVideoSnapshotHeap;
+    sp<AshmemPool> mVideoSnapshotJpegHeap;
+    bool mVideoSnapshotThreadRunning;
+    pthread_t mVideoSnapshotThread;
+    uint32_t mVideoSnapshots;
+    LatencyHistogram mVideoSnapshotLatency;
+    LatencyHistogram mVideoSnapshotCopy;
+    status_t takeVideoSnapshot();
+    void captureVideoSnapshot(int slot);
+    void releaseVideoSnapshotHeaps();
+    void videoSnapshotDropped();
+    friend void *video_snapshot_thread(void *user);
+    void runVideoSnapshotThread(void *data);
+    void reapVideoSnapshotThread();
+
+    // The frame thread polls the frame fd together with the read end of
+    // mFrameThreadPipe; writing to the pipe wakes it up or stops it.
     bool mFrameThreadRunning;
+    bool mFrameThreadStarted;
+    int mFrameThreadPipe[2];
     Mutex mFrameThreadWaitLock;
     Condition mFrameThreadWait;
     friend void *frame_thread(void *user);
     void runFrameThread(void *data);
+    bool startFrameThread(struct msm_frame_t *frame);
+    void stopFrameThread();
+    void wakeFrameThread();
 
     bool mShutterPending;
     Mutex mShutterLock;
+    nsecs_t mShutterRequestTime;
+    LatencyHistogram mShutterLag;
+    LatencyHistogram mShutterToJpeg;
 
     bool mSnapshotThreadRunning;
     Mutex mSnapshotThreadWaitLock;
@@ -322,26 +506,113 @@ private:
     friend void *snapshot_thread(void *user);
     void runSnapshotThread(void *data);
 
+    // Preview is restarted by the snapshot thread as soon as the last raw
+    // frame has been copied out, but stays paused (no callbacks, and
+    // previewEnabled() false) until the application asks for it again.
+    // The restart runs after the thread has signalled completion, so a
+    // takePicture() may already be under way; each snapshot thread only
+    // restarts preview for its own generation.
+    bool mPreviewRestartPending;
+    bool mPreviewPaused;
+    int mSnapshotGeneration;
+    LatencyHistogram mShotToPreview;
+    void restartPreviewAfterSnapshot(int generation);
+
     void initDefaultParameters();
 
-    void setAntibanding();
-    void setEffect();
-    void setWhiteBalance();
-    void setZoom();
+    // Driver-side settings, parsed out of CameraParameters once per
+    // setParameters().  mAppliedSettings is what the driver last accepted;
+    // applyDriverSettings() sends only the difference.  NOT_FOUND means
+    // unset.
+    struct DriverSettings {
+        int32_t effect;
+        int32_t whiteBalance;
+        int32_t zoomStep;
+        int32_t zoom;
+    };
+    DriverSettings mWantedSettings;
+    DriverSettings mAppliedSettings;
+    uint32_t mParmCommandsSent;
+    uint32_t mParmCommandsSkipped;
+    LatencyHistogram mSetParametersCost;
+    void parseDriverSettings(const CameraParameters& params,
+                             DriverSettings *settings);
+    void applyDriverSettings();
+    bool setZoom(int32_t step, int32_t index);
+
+    // Zoom changes only move mZoomTarget (in driver units) and the zoom
+    // thread applies it, so neither setParameters() nor sendCommand()
+    // waits for the VFE to settle.  A plain zoom change goes to the driver
+    // in one command; only a smooth zoom walks it one driver step at a
+    // time, waiting at least a frame between steps.
+    mutable Mutex mZoomLock;
+    Condition mZoomCondition;
+    pthread_t mZoomThread;
+    bool mZoomThreadRunning;
+    bool mZoomThreadExit;
+    int mZoomStep;
+    int32_t mZoomTarget;
+    int32_t mZoomCurrent;
+    bool mSmoothZooming;
+    friend void *zoom_thread(void *user);
+    void runZoomThread(void *data);
+    bool startZoomThread();
+    void stopZoomThread();
+    bool requestZoom(int index, bool smooth);
+    void stopSmoothZoom();
+
+    // Where the driver cannot zoom (mZoomStep == 0, i.e. full-size
+    // pictures) zoom is done in software: preview frames are cropped and
+    // scaled back up in place through mZoomScratch, and each shot is
+    // scaled on its way into the encode heap.  The preview cost is kept
+    // per preview size.
+    //
+    // Preview frames are scaled on the soft zoom thread, not the frame
+    // thread: the frame thread queues the slot (holding it) and the soft
+    // zoom thread scales and delivers it.  One frame is queued at most; a
+    // newer one replaces it and the older slot goes back to the driver.
+    // Delivery stays on the soft zoom thread until its queue has drained,
+    // so frames are never delivered out of order.
+    static const int kPreviewSizeCount = 4;
+    int mSoftZoomRatio;
+    int mPreviewSizeIndex;
+    uint8_t *mZoomScratch;
+    int mZoomScratchSize;
+    LatencyHistogram mSoftZoomPreviewCost[kPreviewSizeCount];
+    LatencyHistogram mSoftZoomSnapshotCost;
+    Mutex mSoftZoomLock;
+    Condition mSoftZoomCondition;
+    pthread_t mSoftZoomThread;
+    bool mSoftZoomThreadRunning;
+    bool mSoftZoomThreadExit;
+    bool mSoftZoomDelivering;
+    int mSoftZoomQueuedSlot;
+    nsecs_t mSoftZoomQueuedTime;
+    uint32_t mSoftZoomFramesReplaced;
+    void softZoomPreviewFrame(int slot);
+    bool queueSoftZoomFrame(int slot, nsecs_t captureTime);
+    friend void *soft_zoom_thread(void *user);
+    void runSoftZoomThread(void *data);
+    void stopSoftZoomThread();
 
-    int mEffect;
-    int mWhiteBalance;
-    
     Mutex mLock;
-    bool mReleasedRecordingFrame;
 
-    void receiveRawPicture(void);
+    void receiveRawPicture(int slot, int shot, int count, bool merge,
+                           nsecs_t requestTime);
 
 
-    Mutex mRecordLock;
+    // Video frames handed to the encoder and not yet returned through
+    // releaseRecordingFrame(), indexed by preview ring slot.
     Mutex mRecordFrameLock;
-    Condition mRecordWait;
-    Condition mStateWait;
+    bool mRecordFrameHeld[kPreviewBufferCountMax];
+    int mRecordFramesHeld;
+    int mRecordFramesHeldMax;
+    uint32_t mRecordFramesDelivered;
+    uint32_t mRecordFramesDropped;
+
+    // Buffers that must stay out of the encoder's hands: one being filled
+    // by the VFE and one on display.
+    static const int kMinFreePreviewBuffers = 2;
 
     /* mJpegSize keeps track of the size of the accumulated JPEG.  We clear it
        when we are about to take a picture, so at any time it contains either
@@ -374,7 +645,88 @@ private:
 
     common_crop_t mCrop;
 
-    struct msm_frame_t frames[kPreviewBufferCount];
+    nsecs_t mPreviewStartLatency;
+    nsecs_t mPreviewStopLatency;
+
+    // Frame capture times, estimated from the frame thread's wakeups.
+    // The period is only tracked between 60 and 5 fps.
+    static const nsecs_t kMinFramePeriod = 1000000000LL / 60;
+    static const nsecs_t kMaxFramePeriod = 1000000000LL / 5;
+    nsecs_t mLastCaptureTime;
+    nsecs_t mFramePeriod;
+    nsecs_t estimateCaptureTime(nsecs_t observed);
+    LatencyHistogram mCaptureToCallback;
+    LatencyHistogram mPreviewToCallback;
+    LatencyHistogram mPreviewCallbackTime;
+    LatencyHistogram mFrameThreadTime;
+
+    // Per-shot pipeline stages, in order.  The encode stages are recorded
+    // on the encode thread, the others on the snapshot thread.
+    enum {
+        CAPTURE_SHUTTER,
+        CAPTURE_RAW_READY,
+        CAPTURE_ENCODE_START,
+        CAPTURE_ENCODE_END,
+        CAPTURE_EXIF_DONE,
+        CAPTURE_DELIVERED,
+        CAPTURE_STAGE_COUNT
+    };
+    LatencyHistogram mCaptureStages[CAPTURE_STAGE_COUNT];
+
+    // Preview ring: one pmem region per slot, count taken from
+    // persist.camera.preview.buffers. A slot is requeued to the VFE only
+    // when its reference count drops to zero.
+    int mPreviewBufferCount;
+    struct msm_frame_t frames[kPreviewBufferCountMax];
+    int mPreviewSlotRefs[kPreviewBufferCountMax];
+    int mDisplayedPreviewSlot;
+    Mutex mPreviewSlotLock;
+    int previewSlotFor(const struct msm_frame_t *frame) const;
+    void acquirePreviewSlot(int slot);
+    void releasePreviewSlot(int slot);
+
+    // Preview frames can also be handed to the application converted, as
+    // chosen by the preview-converted-format parameter, for clients that
+    // draw them themselves.  CAMERA_MSG_PREVIEW_FRAME keeps carrying the
+    // NV21 ring slot, which is what the display path is fed from; the
+    // converted copy goes out as CAMERA_MSG_PREVIEW_CONVERTED, whenever
+    // the parameter is not off, from a small ashmem heap that alternates
+    // between its buffers.
+    enum {
+        PREVIEW_FORMAT_YUV420SP,
+        PREVIEW_FORMAT_RGB565,
+        PREVIEW_FORMAT_LUMA_HALF
+    };
+    static const int kConvertBufferCount = 2;
+    int mPreviewFormat;
+    Mutex mConvertLock;
+    sp<AshmemPool> mConvertHeap;
+    int mConvertWidth;
+    int mConvertHeight;
+    int mConvertSlot;
+    LatencyHistogram mPreviewConvertCost;
+    void setPreviewConversion(int format);
+    sp<MemoryBase> convertPreviewFrame(int slot);
+
+    // Secondary preview stream: every mSecondaryDecimation-th frame, luma
+    // only, box filtered down by 1 << mSecondaryShift, sent as
+    // CAMERA_MSG_PREVIEW_SECONDARY out of its own small heap while
+    // preview-secondary-decimation is above 0.  Also guarded by
+    // mConvertLock.
+    static const int kSecondaryBufferCount = 2;
+    static const int kSecondaryShiftMax = 3;
+    int mSecondaryDecimation;
+    int mSecondaryShift;
+    sp<AshmemPool> mSecondaryHeap;
+    int mSecondaryWidth;
+    int mSecondaryHeight;
+    int mSecondarySlot;
+    uint32_t mSecondaryFrameCount;
+    uint32_t mSecondaryFramesSent;
+    LatencyHistogram mSecondaryCost;
+    void setSecondaryPreview(int decimation, int shift);
+    sp<MemoryBase> secondaryPreviewFrame(int slot);
+
     bool mInPreviewCallback;
     bool mCameraRecording;
 };
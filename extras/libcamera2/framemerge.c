@@ -0,0 +1,110 @@
+#include "framemerge.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* SMUAD blends a sample pair with a weight pair in one instruction. */
+#if (defined(__ARM_ARCH_6__) || defined(__ARM_ARCH_6J__) || \
+     defined(__ARM_ARCH_6K__) || defined(__ARM_ARCH_6Z__) || \
+     defined(__ARM_ARCH_6ZK__) || defined(__ARM_ARCH_7A__)) && \
+    (!defined(__thumb__) || defined(__thumb2__))
+#define HAVE_ARMV6_SIMD 1
+#else
+#define HAVE_ARMV6_SIMD 0
+#endif
+
+#if HAVE_ARMV6_SIMD
+static inline uint32_t smuad(uint32_t a, uint32_t b)
+{
+    uint32_t r;
+    __asm__("smuad %0, %1, %2" : "=r" (r) : "r" (a), "r" (b));
+    return r;
+}
+#else
+static inline uint32_t smuad(uint32_t a, uint32_t b)
+{
+    return (a & 0xffff) * (b & 0xffff) + (a >> 16) * (b >> 16);
+}
+#endif
+
+void luma_projections(const uint8_t *luma, int width, int height,
+                      uint32_t *cols, uint32_t *rows)
+{
+    int x, y;
+
+    memset(cols, 0, width * sizeof(*cols));
+    for (y = 0; y < height; y++) {
+        const uint8_t *p = luma + y * width;
+        uint32_t sum = 0;
+        for (x = 0; x < width; x += 2)
+            sum += p[x];
+        rows[y] = sum;
+        if (!(y & 1))
+            for (x = 0; x < width; x++)
+                cols[x] += p[x];
+    }
+}
+
+int projection_shift(const uint32_t *ref, const uint32_t *cur, int count,
+                     int range)
+{
+    int best = 0;
+    uint64_t best_cost = ~0ULL;
+    int s, i;
+
+    for (s = -range; s <= range; s++) {
+        int first = s < 0 ? -s : 0;
+        int last = s > 0 ? count - s : count;
+        uint64_t cost = 0;
+
+        if (last - first < count / 2)
+            continue;
+        for (i = first; i < last; i++) {
+            int32_t d = (int32_t)(ref[i] - cur[i + s]);
+            cost += d < 0 ? -d : d;
+        }
+        /* Compare means, scaled to keep integer precision. */
+        cost = (cost << 8) / (last - first);
+        if (cost < best_cost || (cost == best_cost && abs(s) < abs(best))) {
+            best_cost = cost;
+            best = s;
+        }
+    }
+
+    return best;
+}
+
+/* Blends a rectangle of one plane; channels bytes per pixel. */
+static void merge_plane(uint8_t *acc, const uint8_t *frame, int stride,
+                        int channels, int width, int height, int dx, int dy,
+                        uint32_t weights)
+{
+    int x0 = dx < 0 ? -dx : 0;
+    int x1 = dx > 0 ? width - dx : width;
+    int y0 = dy < 0 ? -dy : 0;
+    int y1 = dy > 0 ? height - dy : height;
+    int x, y;
+
+    for (y = y0; y < y1; y++) {
+        uint8_t *a = acc + y * stride + x0 * channels;
+        const uint8_t *f = frame + (y + dy) * stride + (x0 + dx) * channels;
+        int n = (x1 - x0) * channels;
+        for (x = 0; x < n; x++)
+            a[x] = (smuad(a[x] | (f[x] << 16), weights) + 128) >> 8;
+    }
+}
+
+void yuv420sp_merge(uint8_t *acc, const uint8_t *frame, int width, int height,
+                    int dx, int dy, int weight)
+{
+    uint32_t weights = (256 - weight) | (weight << 16);
+
+    merge_plane(acc, frame, width, 1, width, height, dx, dy, weights);
+    merge_plane(acc + width * height, frame + width * height, width, 2,
+                width / 2, height / 2, dx / 2, dy / 2, weights);
+}
+
+const char *framemerge_kernels(void)
+{
+    return HAVE_ARMV6_SIMD ? "armv6" : "c";
+}
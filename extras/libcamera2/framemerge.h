@@ -0,0 +1,32 @@
+#ifndef ANDROID_HARDWARE_FRAMEMERGE_H
+#define ANDROID_HARDWARE_FRAMEMERGE_H
+
+#include <stdint.h>
+
+/* Multi-frame noise reduction on NV21 frames of the same size. */
+
+/* Column and row sums of the luma plane, over every other row and column
+ * respectively: cols holds width entries, rows height entries.
+ */
+void luma_projections(const uint8_t *luma, int width, int height,
+                      uint32_t *cols, uint32_t *rows);
+
+/* The shift s in [-range, range] for which cur[i + s] best matches ref[i],
+ * by mean absolute difference over the overlap.
+ */
+int projection_shift(const uint32_t *ref, const uint32_t *cur, int count,
+                     int range);
+
+/* Blends frame, displaced by (dx, dy), into acc: acc += (frame - acc) *
+ * weight / 256.  dx and dy must be even.  Pixels of acc that the
+ * displaced frame does not cover are left alone.
+ */
+void yuv420sp_merge(uint8_t *acc, const uint8_t *frame, int width, int height,
+                    int dx, int dy, int weight);
+
+/* "armv6" when the ARMv6 media instruction kernels were compiled in, "c"
+ * for the portable fallbacks.
+ */
+const char *framemerge_kernels(void);
+
+#endif
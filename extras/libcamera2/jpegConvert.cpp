@@ -47,16 +47,19 @@ bool YuvToJpegEncoder::encode(unsigned char* dest, void* inYuv, int width,
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
     long unsigned int image_size;
+    unsigned char *buffer = dest;
 
-    // Warning, this is ONLY valid for YUV420SP (ImageFormat.NV21 in android)
-    image_size = (width*height*1.5);
+    // *mSize is the room at dest; 0 means the size of the uncompressed
+    // picture.  Warning, this is ONLY valid for YUV420SP (ImageFormat.NV21
+    // in android)
+    image_size = *mSize ? *mSize : (width*height*1.5);
 
     // Create JPEG compression object
     cinfo.err = jpeg_std_error(&jerr);
     jpeg_create_compress(&cinfo);
 
     // Point it to the output file
-    jpeg_mem_dest(&cinfo, &dest, &image_size);
+    jpeg_mem_dest(&cinfo, &buffer, &image_size);
 
     setJpegCompressStruct(&cinfo, width, height, jpegQuality);
 
@@ -65,9 +68,17 @@ bool YuvToJpegEncoder::encode(unsigned char* dest, void* inYuv, int width,
     compress(&cinfo, (uint8_t*) inYuv, offsets);
 
     jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
 
     *mSize = (uint32_t) image_size;
     mJpegTam = (uint32_t) image_size;
+
+    // Out of room at dest, the library carries on in a buffer of its own;
+    // all the caller gets from that is the size it would have needed.
+    if (buffer != dest) {
+        free(buffer);
+        return false;
+    }
     return true;
 }
 
@@ -174,10 +185,11 @@ int yuv420_save2jpeg(unsigned char *dest, void *src, int width, int height, int
     // in android
     imgOffsets[0] = 0;
     imgOffsets[1] = width*height;
-    encoder->encode(dest, src, width, height, imgOffsets, quality, mSize);
+    bool fits = encoder->encode(dest, src, width, height, imgOffsets, quality,
+                                mSize);
 
     delete encoder;
 
-    return true;
+    return fits;
 }
 
@@ -26,7 +26,10 @@ public:
      *  @param height Height of the Yuv data in terms of pixels.
      *  @param offsets The offsets in each image plane with respect to inYuv.
      *  @param jpegQuality Picture quality in [0, 100].
-     *  @return true if successfully compressed the stream.
+     *  @param mSize In: room at dest, or 0 for the uncompressed size.
+     *               Out: size of the compressed picture.
+     *  @return true if successfully compressed the stream, false if it
+     *          did not fit at dest.
      */
     bool encode(unsigned char* dest, void* inYuv, int width,
         int height, int* offsets, int jpegQuality, uint32_t* mSize);
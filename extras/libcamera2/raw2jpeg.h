@@ -1 +1,3 @@
+/* *mSize is the room at dest on the way in (0: the uncompressed size) and
+   the picture size on the way out; returns 0 if the picture did not fit. */
 int yuv420_save2jpeg(unsigned char *dest, void *src, int width, int height, int quality, uint32_t *mSize);
@@ -0,0 +1,242 @@
+#include "yuvconvert.h"
+
+#include <string.h>
+
+/* The MSM7x01 ARM11 core has the ARMv6 media instructions: USAT clamps
+ * and shifts a channel straight to its RGB565 field width, and UHADD8
+ * averages four byte lanes at once.  Thumb-1 has neither, so Android.mk
+ * builds this file as ARM code for ARMv6.  Other targets get the plain
+ * C versions below, which produce the same rounding for RGB565.
+ */
+#if (defined(__ARM_ARCH_6__) || defined(__ARM_ARCH_6J__) || \
+     defined(__ARM_ARCH_6K__) || defined(__ARM_ARCH_6Z__) || \
+     defined(__ARM_ARCH_6ZK__) || defined(__ARM_ARCH_7A__)) && \
+    (!defined(__thumb__) || defined(__thumb2__))
+#define HAVE_ARMV6_SIMD 1
+#else
+#define HAVE_ARMV6_SIMD 0
+#endif
+
+/* Channel values arrive as 8.8 fixed point, already rounded for the
+ * field width; these drop the fraction and the low bits and clamp.
+ */
+#if HAVE_ARMV6_SIMD
+static inline uint32_t sat5(int32_t x)
+{
+    uint32_t r;
+    __asm__("usat %0, #5, %1, asr #11" : "=r" (r) : "r" (x));
+    return r;
+}
+
+static inline uint32_t sat6(int32_t x)
+{
+    uint32_t r;
+    __asm__("usat %0, #6, %1, asr #10" : "=r" (r) : "r" (x));
+    return r;
+}
+
+static inline uint32_t uhadd8(uint32_t a, uint32_t b)
+{
+    uint32_t r;
+    __asm__("uhadd8 %0, %1, %2" : "=r" (r) : "r" (a), "r" (b));
+    return r;
+}
+
+/* Sum of the products of the two halfword pairs. */
+static inline uint32_t smuad(uint32_t a, uint32_t b)
+{
+    uint32_t r;
+    __asm__("smuad %0, %1, %2" : "=r" (r) : "r" (a), "r" (b));
+    return r;
+}
+#else
+static inline uint32_t sat5(int32_t x)
+{
+    x >>= 11;
+    return x < 0 ? 0 : x > 31 ? 31 : x;
+}
+
+static inline uint32_t sat6(int32_t x)
+{
+    x >>= 10;
+    return x < 0 ? 0 : x > 63 ? 63 : x;
+}
+
+static inline uint32_t smuad(uint32_t a, uint32_t b)
+{
+    return (a & 0xffff) * (b & 0xffff) + (a >> 16) * (b >> 16);
+}
+#endif
+
+static inline uint32_t pack565(int32_t y, int32_t rv, int32_t guv, int32_t bu)
+{
+    return (sat5(y + rv) << 11) | (sat6(y + guv) << 5) | sat5(y + bu);
+}
+
+void yuv420sp_to_rgb565(const uint8_t *yuv, uint16_t *dst,
+                        int width, int height)
+{
+    const uint8_t *vu = yuv + width * height;
+    int row, col;
+
+    for (row = 0; row < height; row += 2) {
+        const uint8_t *y0 = yuv + row * width;
+        const uint8_t *y1 = y0 + width;
+        /* Output rows start on a word boundary because width is even, so
+           two pixels go out per store. */
+        uint32_t *d0 = (uint32_t *)(dst + row * width);
+        uint32_t *d1 = (uint32_t *)(dst + (row + 1) * width);
+
+        for (col = 0; col < width; col += 2) {
+            int32_t v = *vu++ - 128;
+            int32_t u = *vu++ - 128;
+            /* BT.601 video range; rounding for the 5 and 6 bit fields is
+               folded into the chroma terms. */
+            int32_t rv = 409 * v + 1024;
+            int32_t guv = -100 * u - 208 * v + 512;
+            int32_t bu = 516 * u + 1024;
+            int32_t a = 298 * (y0[col] - 16);
+            int32_t b = 298 * (y0[col + 1] - 16);
+            int32_t c = 298 * (y1[col] - 16);
+            int32_t d = 298 * (y1[col + 1] - 16);
+
+            *d0++ = pack565(a, rv, guv, bu) | (pack565(b, rv, guv, bu) << 16);
+            *d1++ = pack565(c, rv, guv, bu) | (pack565(d, rv, guv, bu) << 16);
+        }
+    }
+}
+
+void yuv420sp_to_luma_half(const uint8_t *yuv, uint8_t *dst,
+                           int width, int height)
+{
+    int row, col;
+
+    for (row = 0; row < height; row += 2) {
+        const uint8_t *y0 = yuv + row * width;
+        const uint8_t *y1 = y0 + width;
+
+        col = 0;
+#if HAVE_ARMV6_SIMD
+        /* Eight source columns per pass: average the two rows lane-wise,
+           then neighbouring lanes, and keep the even lanes.  The two
+           halving adds truncate, so this may come out one below the C
+           path. */
+        if (!(((uintptr_t)y0 | (uintptr_t)dst | width) & 3)) {
+            const uint32_t *s0 = (const uint32_t *)y0;
+            const uint32_t *s1 = (const uint32_t *)y1;
+            uint32_t *d = (uint32_t *)dst;
+
+            for (; col + 8 <= width; col += 8) {
+                uint32_t lo = uhadd8(s0[0], s1[0]);
+                uint32_t hi = uhadd8(s0[1], s1[1]);
+                s0 += 2;
+                s1 += 2;
+                lo = uhadd8(lo, lo >> 8);
+                hi = uhadd8(hi, hi >> 8);
+                *d++ = (lo & 0xff) | ((lo >> 8) & 0xff00) |
+                       ((hi & 0xff) << 16) | ((hi & 0xff0000) << 8);
+            }
+            dst = (uint8_t *)d;
+        }
+#endif
+        for (; col < width; col += 2)
+            *dst++ = (y0[col] + y0[col + 1] + y1[col] + y1[col + 1] + 2) >> 2;
+    }
+}
+
+void yuv420sp_to_luma_box(const uint8_t *yuv, uint8_t *dst,
+                          int width, int height, int shift)
+{
+    int factor = 1 << shift;
+    int round = (factor * factor) >> 1;
+    int row, col, i, j;
+
+    if (shift == 0) {
+        memcpy(dst, yuv, width * height);
+        return;
+    }
+    if (shift == 1) {
+        yuv420sp_to_luma_half(yuv, dst, width, height);
+        return;
+    }
+
+    for (row = 0; row < height; row += factor) {
+        for (col = 0; col < width; col += factor) {
+            const uint8_t *src = yuv + row * width + col;
+            uint32_t sum = 0;
+            for (i = 0; i < factor; i++, src += width)
+                for (j = 0; j < factor; j++)
+                    sum += src[j];
+            *dst++ = (sum + round) >> (2 * shift);
+        }
+    }
+}
+
+/* Bilinear scale of a crop of an interleaved plane with channels bytes
+ * per pixel.  Positions are 16.16 fixed point and the weights 8 bit, so
+ * each output sample is two SMUADs: across, then down.
+ */
+static void scale_plane(const uint8_t *src, int stride, int channels,
+                        int left, int top, int crop_width, int crop_height,
+                        uint8_t *dst, int width, int height)
+{
+    uint32_t step_x = ((uint32_t)crop_width << 16) / width;
+    uint32_t step_y = ((uint32_t)crop_height << 16) / height;
+    uint32_t sy = ((uint32_t)top << 16) + (step_y >> 1);
+    int last_x = left + crop_width - 1;
+    int last_y = top + crop_height - 1;
+    int row, col, c;
+
+    for (row = 0; row < height; row++, sy += step_y) {
+        int y0 = sy >> 16;
+        int y1 = y0 < last_y ? y0 + 1 : y0;
+        uint32_t fy = (sy >> 8) & 0xff;
+        uint32_t wy = (256 - fy) | (fy << 16);
+        const uint8_t *r0 = src + y0 * stride;
+        const uint8_t *r1 = src + y1 * stride;
+        uint32_t sx = ((uint32_t)left << 16) + (step_x >> 1);
+
+        for (col = 0; col < width; col++, sx += step_x) {
+            int x0 = sx >> 16;
+            int x1 = x0 < last_x ? x0 + 1 : x0;
+            uint32_t fx = (sx >> 8) & 0xff;
+            uint32_t wx = (256 - fx) | (fx << 16);
+
+            x0 *= channels;
+            x1 *= channels;
+            for (c = 0; c < channels; c++) {
+                uint32_t upper = (smuad(r0[x0 + c] | (r0[x1 + c] << 16), wx)
+                                  + 128) >> 8;
+                uint32_t lower = (smuad(r1[x0 + c] | (r1[x1 + c] << 16), wx)
+                                  + 128) >> 8;
+                *dst++ = (smuad(upper | (lower << 16), wy) + 128) >> 8;
+            }
+        }
+    }
+}
+
+void yuv420sp_zoom(const uint8_t *src, uint8_t *dst,
+                   int width, int height, int ratio_pct)
+{
+    /* Crop on an even grid so luma and chroma stay aligned. */
+    int crop_width = (width * 100 / ratio_pct) & ~1;
+    int crop_height = (height * 100 / ratio_pct) & ~1;
+    int left = ((width - crop_width) / 2) & ~1;
+    int top = ((height - crop_height) / 2) & ~1;
+
+    if (ratio_pct <= 100) {
+        memcpy(dst, src, width * height * 3 / 2);
+        return;
+    }
+
+    scale_plane(src, width, 1, left, top, crop_width, crop_height,
+                dst, width, height);
+    scale_plane(src + width * height, width, 2,
+                left / 2, top / 2, crop_width / 2, crop_height / 2,
+                dst + width * height, width / 2, height / 2);
+}
+
+const char *yuvconvert_kernels(void)
+{
+    return HAVE_ARMV6_SIMD ? "armv6" : "c";
+}
@@ -0,0 +1,37 @@
+#ifndef ANDROID_HARDWARE_YUVCONVERT_H
+#define ANDROID_HARDWARE_YUVCONVERT_H
+
+#include <stdint.h>
+
+/* All kernels take an NV21 frame: a width x height Y plane followed by
+ * an interleaved V/U plane at half resolution.  width and height must be
+ * even.
+ */
+
+/* NV21 to RGB565, BT.601 video range, width * height output pixels. */
+void yuv420sp_to_rgb565(const uint8_t *yuv, uint16_t *dst,
+                        int width, int height);
+
+/* Y plane only, 2x2 box filtered to (width / 2) x (height / 2) bytes. */
+void yuv420sp_to_luma_half(const uint8_t *yuv, uint8_t *dst,
+                           int width, int height);
+
+/* Y plane only, box filtered by 1 << shift in each direction.  width and
+ * height must be multiples of 1 << shift.
+ */
+void yuv420sp_to_luma_box(const uint8_t *yuv, uint8_t *dst,
+                          int width, int height, int shift);
+
+/* Digital zoom: crops the centre 100 / ratio_pct of the frame in each
+ * direction and scales it back up to width x height with bilinear
+ * filtering, both planes.  src and dst must not overlap.
+ */
+void yuv420sp_zoom(const uint8_t *src, uint8_t *dst,
+                   int width, int height, int ratio_pct);
+
+/* "armv6" when the ARMv6 media instruction kernels were compiled in, "c"
+ * for the portable fallbacks.
+ */
+const char *yuvconvert_kernels(void);
+
+#endif
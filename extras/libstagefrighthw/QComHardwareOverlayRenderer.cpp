@@ -79,7 +79,8 @@ QComHardwareOverlayRenderer::QComHardwareOverlayRenderer(
       mFpsSum(0),
       mFrameNumber(0),
       mNumFpsSamples(0),
-      mLastFrameTime(0) {
+      mLastFrameTime(0),
+      mFd(0) {
     CHECK(mISurface.get() != NULL);
     CHECK(mDecodedWidth > 0);
     CHECK(mDecodedHeight > 0);
@@ -89,27 +90,34 @@ QComHardwareOverlayRenderer::QComHardwareOverlayRenderer(
     if (atoi(value)) mStatistics = true;
 
     sp<OverlayRef> ref = mISurface->createOverlay(decodedWidth, decodedHeight, OVERLAY_FORMAT_YCrCb_420_SP, ISurface::BufferHeap::ROT_0);
-    mOverlay = new Overlay(ref);
-    if (mOverlay  == 0){
+    if (ref == NULL) {
          LOGE("Create overlay failed\n");
          return;
-    }else {
-         LOGV("Create overlay successful\n");
-         mFd = 0;
-         mOverlay->setCrop(0,0,displayWidth,displayHeight);
     }
+
+    mOverlay = new Overlay(ref);
+    LOGV("Create overlay successful\n");
+    mOverlay->setCrop(0,0,displayWidth,displayHeight);
 }
 
 QComHardwareOverlayRenderer::~QComHardwareOverlayRenderer() {
     if (mStatistics) AverageFPSPrint();
 
-    if(mOverlay != NULL)
+    // The overlay still references the pmem fd, so it has to go before
+    // the heap is released.
+    if(mOverlay != NULL) {
         mOverlay->destroy();
+        mOverlay.clear();
+    }
     mMemoryHeap.clear();
 }
 
 void QComHardwareOverlayRenderer::render(
         const void *data, size_t size, void *platformPrivate) {
+    if (mOverlay == NULL) {
+        return;
+    }
+
     size_t offset;
     if (!getOffset(platformPrivate, &offset)) {
         LOGE("couldn't get offset");
@@ -153,6 +161,8 @@ bool QComHardwareOverlayRenderer::getOffset(void *platformPrivate, size_t *offse
 }
 
 void QComHardwareOverlayRenderer::publishBuffers(uint32_t pmem_fd) {
+    // The pmem_fd field carries the decoder's master MemoryHeapBase, not a
+    // file descriptor.
     sp<MemoryHeapBase> master =
         reinterpret_cast<MemoryHeapBase *>(pmem_fd);
 
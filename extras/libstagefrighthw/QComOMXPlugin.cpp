@@ -14,51 +14,154 @@
  * limitations under the License.
  */
 
+//#define LOG_NDEBUG 0
+#define LOG_TAG "QComOMXPlugin"
+#include <utils/Log.h>
+
 #include "QComOMXPlugin.h"
 
 #include <dlfcn.h>
+#include <pthread.h>
+#include <string.h>
 
 #include <media/stagefright/HardwareAPI.h>
 #include <media/stagefright/MediaDebug.h>
 
 namespace android {
 
+// How long libOmxCore stays loaded after the last component instance is
+// freed. Long enough to cover seeking and playlist transitions.
+static const int64_t kIdleUnloadDelayUs = 30000000ll;
+
 OMXPluginBase *createOMXPlugin() {
     return new QComOMXPlugin;
 }
 
 QComOMXPlugin::QComOMXPlugin()
-    : mLibHandle(dlopen("libOmxCore.so", RTLD_NOW)),
+    : mLibHandle(NULL),
       mInit(NULL),
       mDeinit(NULL),
       mComponentNameEnum(NULL),
       mGetHandle(NULL),
       mFreeHandle(NULL),
-      mGetRolesOfComponentHandle(NULL) {
-    if (mLibHandle != NULL) {
-        mInit = (InitFunc)dlsym(mLibHandle, "OMX_Init");
-        mDeinit = (DeinitFunc)dlsym(mLibHandle, "OMX_DeInit");
-
-        mComponentNameEnum =
-            (ComponentNameEnumFunc)dlsym(mLibHandle, "OMX_ComponentNameEnum");
-
-        mGetHandle = (GetHandleFunc)dlsym(mLibHandle, "OMX_GetHandle");
-        mFreeHandle = (FreeHandleFunc)dlsym(mLibHandle, "OMX_FreeHandle");
+      mGetRolesOfComponentHandle(NULL),
+      mComponentsCached(false),
+      mNumInstances(0),
+      mIdleSinceUs(0),
+      mIdleThreadStarted(false),
+      mExiting(false) {
+}
 
-        mGetRolesOfComponentHandle =
-            (GetRolesOfComponentFunc)dlsym(
-                    mLibHandle, "OMX_GetRolesOfComponent");
+QComOMXPlugin::~QComOMXPlugin() {
+    {
+        Mutex::Autolock autoLock(mLock);
+        mExiting = true;
+        mIdleCondition.signal();
+    }
 
-        (*mInit)();
+    if (mIdleThreadStarted) {
+        void *dummy;
+        pthread_join(mIdleThread, &dummy);
     }
+
+    Mutex::Autolock autoLock(mLock);
+    unloadCore_l();
 }
 
-QComOMXPlugin::~QComOMXPlugin() {
+bool QComOMXPlugin::loadCore_l() {
     if (mLibHandle != NULL) {
-        (*mDeinit)();
+        return true;
+    }
+
+    int64_t startUs = systemTime() / 1000;
+
+    mLibHandle = dlopen("libOmxCore.so", RTLD_NOW);
+    if (mLibHandle == NULL) {
+        LOGE("could not load libOmxCore.so: %s", dlerror());
+        return false;
+    }
 
+    mInit = (InitFunc)dlsym(mLibHandle, "OMX_Init");
+    mDeinit = (DeinitFunc)dlsym(mLibHandle, "OMX_DeInit");
+
+    mComponentNameEnum =
+        (ComponentNameEnumFunc)dlsym(mLibHandle, "OMX_ComponentNameEnum");
+
+    mGetHandle = (GetHandleFunc)dlsym(mLibHandle, "OMX_GetHandle");
+    mFreeHandle = (FreeHandleFunc)dlsym(mLibHandle, "OMX_FreeHandle");
+
+    mGetRolesOfComponentHandle =
+        (GetRolesOfComponentFunc)dlsym(
+                mLibHandle, "OMX_GetRolesOfComponent");
+
+    if (mInit == NULL || mDeinit == NULL || mComponentNameEnum == NULL
+            || mGetHandle == NULL || mFreeHandle == NULL
+            || mGetRolesOfComponentHandle == NULL) {
+        LOGE("libOmxCore.so is missing OMX core entry points");
         dlclose(mLibHandle);
         mLibHandle = NULL;
+        return false;
+    }
+
+    (*mInit)();
+
+    LOGV("loaded libOmxCore.so in %lld us", systemTime() / 1000 - startUs);
+
+    if (!mIdleThreadStarted) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+        mIdleThreadStarted =
+            !pthread_create(&mIdleThread, &attr, IdleThreadWrapper, this);
+        pthread_attr_destroy(&attr);
+    }
+
+    return true;
+}
+
+void QComOMXPlugin::unloadCore_l() {
+    if (mLibHandle == NULL) {
+        return;
+    }
+
+    LOGV("unloading libOmxCore.so");
+
+    (*mDeinit)();
+
+    dlclose(mLibHandle);
+    mLibHandle = NULL;
+
+    mInit = NULL;
+    mDeinit = NULL;
+    mComponentNameEnum = NULL;
+    mGetHandle = NULL;
+    mFreeHandle = NULL;
+    mGetRolesOfComponentHandle = NULL;
+}
+
+// static
+void *QComOMXPlugin::IdleThreadWrapper(void *me) {
+    static_cast<QComOMXPlugin *>(me)->idleThread();
+    return NULL;
+}
+
+void QComOMXPlugin::idleThread() {
+    Mutex::Autolock autoLock(mLock);
+
+    while (!mExiting) {
+        if (mLibHandle == NULL || mNumInstances > 0) {
+            mIdleCondition.wait(mLock);
+            continue;
+        }
+
+        int64_t idleUs = systemTime() / 1000 - mIdleSinceUs;
+        if (idleUs >= kIdleUnloadDelayUs) {
+            unloadCore_l();
+            continue;
+        }
+
+        mIdleCondition.waitRelative(
+                mLock, (kIdleUnloadDelayUs - idleUs) * 1000ll);
     }
 }
 
@@ -67,34 +170,65 @@ OMX_ERRORTYPE QComOMXPlugin::makeComponentInstance(
         const OMX_CALLBACKTYPE *callbacks,
         OMX_PTR appData,
         OMX_COMPONENTTYPE **component) {
-    if (mLibHandle == NULL) {
+    Mutex::Autolock autoLock(mLock);
+
+    if (!loadCore_l()) {
         return OMX_ErrorUndefined;
     }
 
-    return (*mGetHandle)(
+    OMX_ERRORTYPE err = (*mGetHandle)(
             reinterpret_cast<OMX_HANDLETYPE *>(component),
             const_cast<char *>(name),
             appData, const_cast<OMX_CALLBACKTYPE *>(callbacks));
+
+    if (err == OMX_ErrorNone) {
+        ++mNumInstances;
+    } else if (mNumInstances == 0) {
+        markIdle_l();
+    }
+
+    return err;
 }
 
 OMX_ERRORTYPE QComOMXPlugin::destroyComponentInstance(
         OMX_COMPONENTTYPE *component) {
+    Mutex::Autolock autoLock(mLock);
+
     if (mLibHandle == NULL) {
         return OMX_ErrorUndefined;
     }
 
-    return (*mFreeHandle)(reinterpret_cast<OMX_HANDLETYPE *>(component));
+    OMX_ERRORTYPE err =
+        (*mFreeHandle)(reinterpret_cast<OMX_HANDLETYPE *>(component));
+
+    if (mNumInstances > 0 && --mNumInstances == 0) {
+        markIdle_l();
+    }
+
+    return err;
 }
 
 OMX_ERRORTYPE QComOMXPlugin::enumerateComponents(
         OMX_STRING name,
         size_t size,
         OMX_U32 index) {
-    if (mLibHandle == NULL) {
+    Mutex::Autolock autoLock(mLock);
+    if (!cacheComponents_l()) {
         return OMX_ErrorUndefined;
     }
 
-    return (*mComponentNameEnum)(name, size, index);
+    if (index >= mComponents.size()) {
+        return OMX_ErrorNoMore;
+    }
+
+    const String8 &componentName = mComponents.itemAt(index).mName;
+    if (componentName.length() >= size) {
+        return OMX_ErrorBadParameter;
+    }
+
+    strcpy(name, componentName.string());
+
+    return OMX_ErrorNone;
 }
 
 OMX_ERRORTYPE QComOMXPlugin::getRolesOfComponent(
@@ -102,44 +236,97 @@ OMX_ERRORTYPE QComOMXPlugin::getRolesOfComponent(
         Vector<String8> *roles) {
     roles->clear();
 
-    if (mLibHandle == NULL) {
+    Mutex::Autolock autoLock(mLock);
+    if (!cacheComponents_l()) {
         return OMX_ErrorUndefined;
     }
 
-    OMX_U32 numRoles;
-    OMX_ERRORTYPE err = (*mGetRolesOfComponentHandle)(
-            const_cast<OMX_STRING>(name), &numRoles, NULL);
+    const ComponentInfo *info = findComponent_l(name);
+    if (info == NULL) {
+        return OMX_ErrorInvalidComponentName;
+    }
 
-    if (err != OMX_ErrorNone) {
-        return err;
+    *roles = info->mRoles;
+
+    return OMX_ErrorNone;
+}
+
+void QComOMXPlugin::markIdle_l() {
+    // Let the idle thread unload the core again.
+    mIdleSinceUs = systemTime() / 1000;
+    mIdleCondition.signal();
+}
+
+bool QComOMXPlugin::cacheComponents_l() {
+    if (mComponentsCached) {
+        return true;
     }
 
-    if (numRoles > 0) {
-        OMX_U8 **array = new OMX_U8 *[numRoles];
-        for (OMX_U32 i = 0; i < numRoles; ++i) {
-            array[i] = new OMX_U8[OMX_MAX_STRINGNAME_SIZE];
-        }
+    // The table is read out of the core itself, so it can never list a
+    // component the core does not have. This is the only time the core
+    // is loaded before something is actually instantiated.
+    if (!loadCore_l()) {
+        return false;
+    }
 
-        OMX_U32 numRoles2;
-        err = (*mGetRolesOfComponentHandle)(
-                const_cast<OMX_STRING>(name), &numRoles2, array);
+    // libOmxCore never reports more than one role per component; the
+    // spare slots only guard against a core that does.
+    static const OMX_U32 kMaxRolesPerComponent = 4;
+
+    OMX_U8 roleStorage[kMaxRolesPerComponent][OMX_MAX_STRINGNAME_SIZE];
+    OMX_U8 *roleArray[kMaxRolesPerComponent];
+    for (OMX_U32 i = 0; i < kMaxRolesPerComponent; ++i) {
+        roleArray[i] = roleStorage[i];
+    }
 
-        CHECK_EQ(err, OMX_ErrorNone);
-        CHECK_EQ(numRoles, numRoles2);
+    char componentName[OMX_MAX_STRINGNAME_SIZE];
+    for (OMX_U32 index = 0;
+         (*mComponentNameEnum)(
+                componentName, sizeof(componentName), index) == OMX_ErrorNone;
+         ++index) {
+        ComponentInfo info;
+        info.mName = componentName;
 
-        for (OMX_U32 i = 0; i < numRoles; ++i) {
-            String8 s((const char *)array[i]);
-            roles->push(s);
+        // A single call with a caller-sized array; the core writes back
+        // how many roles it filled in.
+        OMX_U32 numRoles = kMaxRolesPerComponent;
+        OMX_ERRORTYPE err = (*mGetRolesOfComponentHandle)(
+                componentName, &numRoles, roleArray);
 
-            delete[] array[i];
-            array[i] = NULL;
+        if (err == OMX_ErrorNone) {
+            if (numRoles > kMaxRolesPerComponent) {
+                numRoles = kMaxRolesPerComponent;
+            }
+            for (OMX_U32 i = 0; i < numRoles; ++i) {
+                roleStorage[i][OMX_MAX_STRINGNAME_SIZE - 1] = '\0';
+                info.mRoles.push(String8((const char *)roleStorage[i]));
+            }
+        } else {
+            LOGW("could not get roles of %s (err %d)", componentName, err);
         }
 
-        delete[] array;
-        array = NULL;
+        mComponents.push(info);
     }
 
-    return OMX_ErrorNone;
+    LOGV("cached %d components", mComponents.size());
+    mComponentsCached = true;
+
+    if (mNumInstances == 0) {
+        markIdle_l();
+    }
+
+    return true;
+}
+
+const QComOMXPlugin::ComponentInfo *QComOMXPlugin::findComponent_l(
+        const char *name) {
+    for (size_t i = 0; i < mComponents.size(); ++i) {
+        if (!strcmp(mComponents.itemAt(i).mName.string(), name)) {
+            return &mComponents.itemAt(i);
+        }
+    }
+
+    return NULL;
 }
 
 }  // namespace android
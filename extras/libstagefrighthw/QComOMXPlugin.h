@@ -19,6 +19,11 @@
 #define QCOM_OMX_PLUGIN_H_
 
 #include <media/stagefright/OMXPluginBase.h>
+#include <utils/String8.h>
+#include <utils/threads.h>
+#include <utils/Vector.h>
+
+#include <pthread.h>
 
 namespace android {
 
@@ -67,6 +72,37 @@ private:
     FreeHandleFunc mFreeHandle;
     GetRolesOfComponentFunc mGetRolesOfComponentHandle;
 
+    // Component names and roles never change once the core is loaded, so
+    // they are read out of it once and served from here afterwards.
+    struct ComponentInfo {
+        String8 mName;
+        Vector<String8> mRoles;
+    };
+
+    Mutex mLock;
+    bool mComponentsCached;
+    Vector<ComponentInfo> mComponents;
+
+    // libOmxCore is only loaded when the component table is first needed
+    // or a component is instantiated, and is unloaded again by the idle
+    // thread when no instance has been alive for a while.
+    size_t mNumInstances;
+    int64_t mIdleSinceUs;
+    Condition mIdleCondition;
+    pthread_t mIdleThread;
+    bool mIdleThreadStarted;
+    bool mExiting;
+
+    bool loadCore_l();
+    void unloadCore_l();
+    void markIdle_l();
+
+    static void *IdleThreadWrapper(void *me);
+    void idleThread();
+
+    bool cacheComponents_l();
+    const ComponentInfo *findComponent_l(const char *name);
+
     QComOMXPlugin(const QComOMXPlugin &);
     QComOMXPlugin &operator=(const QComOMXPlugin &);
 };